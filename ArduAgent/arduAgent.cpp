@@ -64,6 +64,9 @@ SNMP_API_STAT_CODES arduAgentClass::begin(){
  * This is the function that runs every so often within the user's main program
  * to check to see if a PDU is available. If a packet is available, we jump
  * to our requestPdu function.
+ * Up to SNMP_MAX_BATCH datagrams that are already waiting in the receive
+ * buffer are handled in a single call, so a burst of requests doesn't have
+ * to wait for the rest of loop() between each one.
  * 
  *
  * Parameters: 
@@ -82,8 +85,23 @@ void arduAgentClass::listen(void){
 	we actually go to the memory location of the function
 	pduReceived and begin to run there. Its like a super
 	ghetto goto.*/
-	Udp.parsePacket();
-	if ( Udp.available() && _callback != NULL ) (*_callback)();
+	runSamplers();
+#if SNMP_USM
+	usmTick();
+#endif
+	for (int batch = 0; batch < SNMP_MAX_BATCH; batch++)
+	{
+		_packetSize = Udp.parsePacket();
+		if ( _packetSize == 0 ) return;
+		// Remember who to answer before the callback runs
+		IPAddress remote = Udp.remoteIP();
+		for (int i = 0; i < 4; i++)
+		{
+			_dstIp[i] = remote[i];
+		}
+		_dstPort = Udp.remotePort();
+		if ( _callback != NULL ) (*_callback)();
+	}
 }
 
 /**************************************************************************//**
@@ -129,6 +147,80 @@ SNMP_API_STAT_CODES arduAgentClass::begin(char *getCommName, char *setCommName,
 	return SNMP_API_STAT_SUCCESS;
 }
 
+#if SNMP_USM
+/**************************************************************************//**
+ * Function: beginUsm (password)
+ *
+ * Description:
+ * Enables SNMPv3 for one USM user with HMAC-SHA-96 authentication (no
+ * privacy). The password is turned into the localized key here, once,
+ * which hashes a megabyte and takes seconds on a small board. Use the
+ * other version of this function with a key made ahead of time by
+ * usmPasswordToKey() to skip that. Call begin() as well.
+ * engineBoots must go up by one every time the board starts, so the user's
+ * program should keep it in EEPROM.
+ *
+ * Parameters: 
+ * const char *userName - The USM user name
+ * const char *authPassword - The user's authentication password
+ * const byte engineID[] - This agent's engine ID (5 to 32 bytes)
+ * byte engineIDLength - Number of bytes in engineID
+ * uint32_t engineBoots - Number of times the agent has started
+ *
+ * Returns:
+ *  SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - SNMPv3 enabled
+ *  SNMP_API_STAT_CODES SNMP_API_STAT_NAME_TOO_BIG - User name or engine ID
+ *		the wrong size
+ *
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::beginUsm(const char *userName, const char *authPassword, const byte engineID[], byte engineIDLength, uint32_t engineBoots){
+	byte key[SNMP_SHA1_DIGEST_LEN];
+	if ( engineIDLength < 5 || engineIDLength > SNMP_USM_MAX_ENGINE_ID ) {
+		return SNMP_API_STAT_NAME_TOO_BIG;
+	}
+	usmPasswordToKey(authPassword, engineID, engineIDLength, key);
+	return beginUsm(userName, key, engineID, engineIDLength, engineBoots);
+}
+
+/**************************************************************************//**
+ * Function: beginUsm (localized key)
+ *
+ * Description:
+ * Same as the password version, but takes the 20 byte key already
+ * localized to engineID. Only the HMAC pad states are kept, not the key.
+ *
+ * Parameters: 
+ * const char *userName - The USM user name
+ * const byte authKey[] - The user's localized authentication key
+ * const byte engineID[] - This agent's engine ID (5 to 32 bytes)
+ * byte engineIDLength - Number of bytes in engineID
+ * uint32_t engineBoots - Number of times the agent has started
+ *
+ * Returns:
+ *  SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - SNMPv3 enabled
+ *  SNMP_API_STAT_CODES SNMP_API_STAT_NAME_TOO_BIG - User name or engine ID
+ *		the wrong size
+ *
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::beginUsm(const char *userName, const byte authKey[], const byte engineID[], byte engineIDLength, uint32_t engineBoots){
+	size_t userLength = strlen(userName);
+	if ( userLength > SNMP_USM_MAX_USER ||
+		engineIDLength < 5 || engineIDLength > SNMP_USM_MAX_ENGINE_ID ) {
+		return SNMP_API_STAT_NAME_TOO_BIG;
+	}
+	_usmUserName = userName;
+	_usmUserLength = userLength;
+	memcpy(_usmEngineID, engineID, engineIDLength);
+	_usmEngineIDLength = engineIDLength;
+	hmacSha1Prepare(authKey, _usmKey);
+	_usmBoots = engineBoots;
+	_usmTime = 0;
+	_usmLastMillis = millis();
+	_usmEnabled = true;
+	return SNMP_API_STAT_SUCCESS;
+}
+#endif
+
 /**************************************************************************//**
  * Function: onPduReceive
  *
@@ -157,6 +249,12 @@ void arduAgentClass::onPduReceive(onPduReceiveCallback pduReceived){
  * This function does the real heavy lifting. It parses the entire SNMP
  * portion of a received packet into private data. It also performs several
  * error checks and authentication checks on the received packet.
+ * For a GETNEXT, the OID is replaced with its successor from the MIB
+ * passed to setMib(), so the user's program can answer it like a GET.
+ * A GETBULK is handled the same way (see requestBulk), unless the agent
+ * can answer it itself from a sampler's rows.
+ * SNMPv3 messages are checked by requestUsm first, and from then on are
+ * handled the same as v1/v2c.
  * 
  *
  * Parameters: 
@@ -164,32 +262,40 @@ void arduAgentClass::onPduReceive(onPduReceiveCallback pduReceived){
  *
  * Returns:
  *  SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - No errors - Packet parsed
- *  SNMP_API_STAT_CODES SNMP_ERR_TOO_BIG - Packet exceeds maximum packet size
- *		defined in arduAgent.h
+ *  SNMP_API_STAT_CODES SNMP_API_STAT_PACKET_TOO_BIG - Packet exceeds maximum
+ *		packet size defined in arduAgent.h (dropped, nothing sent)
  *	SNMP_API_STAT_CODES SNMP_API_STAT_PACKET_INVALID - Not an SNMP packet or
  *		client not authenticated
+ *	SNMP_API_STAT_CODES SNMP_API_STAT_NO_SUCH_NAME - GETNEXT went past the
+ *		end of the MIB (already answered)
+ *	SNMP_API_STAT_CODES SNMP_API_STAT_NOT_AUTHENTICATED - SNMPv3 message
+ *		failed USM checks (already answered with a report if it asked)
+ *	SNMP_API_STAT_CODES SNMP_API_STAT_ANSWERED - GETBULK of sampler rows
+ *		(already answered)
  *
  *****************************************************************************/
 SNMP_API_STAT_CODES arduAgentClass::requestPdu(){
 	SNMP_ERR_CODES authenticated = SNMP_ERR_NO_ERROR;
 	unsigned short int errorStatusCodeBaseAddress;
-	_packetSize = Udp.available();
-	// reset packet array
-	for (int rstCounter=0; rstCounter < SNMP_MAX_PACKET_LEN; rstCounter++)
-	{
-	_packet[rstCounter] = 0;
-	}
+	uint16_t pos = 0;
+	uint16_t length;
+#if SNMP_USM
+	_usmRequest = false;
+#endif
 	
 	//Validate Packet Size
 	if ( _packetSize != 0 && _packetSize > SNMP_MAX_PACKET_LEN ) {
-		arduAgent.generateErrorPDU(SNMP_ERR_TOO_BIG);
+		// Nothing of it has been read, so _packet still holds the last
+		// response and must not be sent. The next parsePacket() drops it.
 		return SNMP_API_STAT_PACKET_TOO_BIG;
 	}
 	
 	//Get the actual packet and store it for use
 	Udp.read(_packet, _packetSize);
 	
-	
+	// Only the bytes past the end of this packet need clearing, the
+	// rest were just overwritten
+	memset(_packet + _packetSize, 0, SNMP_MAX_PACKET_LEN - _packetSize);
 	
 	//Check to see if the packet is a SNMPv1 packet
 	//This value should always be 0x30
@@ -198,33 +304,60 @@ SNMP_API_STAT_CODES arduAgentClass::requestPdu(){
 		return SNMP_API_STAT_PACKET_INVALID;
 	}
 
-	/* We have a pdu structure that was passed in.
-	We'll now populate that structure from
-	data we received in the buffer*/
-	
-	ans1Header = _packet[0];
-	pdu_length = _packet[1];
-	for(int i = 2; i<6; i++)
+	// SNMPv3 has its own header in front of the PDU
+	if ( berRead(pos, 0x30, length) && berRead(pos, 0x02, length) &&
+		length == 1 && _packet[pos] == 3 )
 	{
-		version[i-2] = _packet[i];
+#if SNMP_USM
+		SNMP_API_STAT_CODES usmStatus = requestUsm();
+		if (usmStatus != SNMP_API_STAT_SUCCESS)
+		{
+			return usmStatus;
+		}
+#else
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+#endif
 	}
-	lengthCommunityName = _packet[6];
-	for (int i = 0; i < (int) lengthCommunityName; i++)
+	else
 	{
-		communityName[i] = _packet[7+i];
+		/* We have a pdu structure that was passed in.
+		We'll now populate that structure from
+		data we received in the buffer*/
+	
+		ans1Header = _packet[0];
+		pdu_length = _packet[1];
+		for(int i = 2; i<6; i++)
+		{
+			version[i-2] = _packet[i];
+		}
+		lengthCommunityName = _packet[6];
+		for (int i = 0; i < (int) lengthCommunityName; i++)
+		{
+			communityName[i] = _packet[7+i];
+		}
+		_pduOffset = 7+lengthCommunityName;
+	}
+	request[0] = _packet[_pduOffset];
+	request[1] = _packet[_pduOffset+1];
+	requestID[0] = _packet[_pduOffset+2];
+	requestID[1] = _packet[_pduOffset+3];
+	requestID[2] = _packet[_pduOffset+4];
+	requestIDlength = 1;	// Don't carry the length over from the last packet
+	if(requestID[1] > sizeof(requestID) - 2){
+		return SNMP_API_STAT_PACKET_INVALID;
 	}
-	request[0] = _packet[7+lengthCommunityName];
-	request[1] = _packet[7+lengthCommunityName+1];
-	requestID[0] = _packet[7+lengthCommunityName+2];
-	requestID[1] = _packet[7+lengthCommunityName+3];
-	requestID[2] = _packet[7+lengthCommunityName+4];
 	if(requestID[1] > 1){
 		requestIDlength=requestID[1];
 		for(int i = 2; i<=requestIDlength; i++){
-			requestID[i]=_packet[7+lengthCommunityName+5+i-2];
+			requestID[i]=_packet[_pduOffset+5+i-2];
 		}
 	}
-	errorStatusCodeBaseAddress = 7+lengthCommunityName+4+requestIDlength;
+	errorStatusCodeBaseAddress = _pduOffset+4+requestIDlength;
+	if (_packet[_pduOffset] == SNMP_GETBULK &&
+		(!shortenInteger(errorStatusCodeBaseAddress) || !shortenInteger(errorStatusCodeBaseAddress+3)))
+	{
+		return SNMP_API_STAT_PACKET_INVALID;
+	}
 	errorStatusCode[0] = _packet[errorStatusCodeBaseAddress++];
 	errorStatusCode[1] = _packet[errorStatusCodeBaseAddress++];
 	errorStatusCode[2] = _packet[errorStatusCodeBaseAddress++];
@@ -237,32 +370,37 @@ SNMP_API_STAT_CODES arduAgentClass::requestPdu(){
 	varbind[1] = _packet[errorStatusCodeBaseAddress++];
 	objectID = _packet[errorStatusCodeBaseAddress++];
 	oidLength = _packet[errorStatusCodeBaseAddress];
-	for(int i=0; i < (int) oidLength; i++)
-	{
-		oid[i] = _packet[7+lengthCommunityName+16+i+requestIDlength];
-	}	
+	if (oidLength > SNMP_MAX_OID_LEN){
+		return SNMP_API_STAT_PACKET_INVALID;
+	}
 	if (arduAgent.requestType() == SNMP_SET)
 	{
 		// Read in the value the client wants to set
 		//Serial.println("Set Command Detected");
-		if (_packet[7+lengthCommunityName+16+(int) oidLength+requestIDlength]==0x02){
-			setValueInt = _packet[9+lengthCommunityName+16+(int) oidLength+requestIDlength];
-		}
-		else if (_packet[7+lengthCommunityName+16+(int) oidLength+requestIDlength]==0x04){
+		// Integers are decoded by receivedInteger() when set() asks
+		if (_packet[_pduOffset+16+(int) oidLength+requestIDlength]==0x04){
 			int len=0;
-			len = _packet[8+lengthCommunityName+16+(int) oidLength+requestIDlength];
+			len = _packet[_pduOffset+17+(int) oidLength+requestIDlength];
 			if (len > SNMP_MAX_SET_LEN){
 				return SNMP_API_STAT_PACKET_INVALID;
 			}
 			for(int i=0; i < len; i++)
 			{
-				setValueChar[i] = _packet[9+lengthCommunityName+16+(int) oidLength+requestIDlength+i];
+				setValueChar[i] = _packet[_pduOffset+18+(int) oidLength+requestIDlength+i];
 			}
 		}
 	}
 	authenticated = generalAuthenticator();
 	if(authenticated == SNMP_ERR_NO_ERROR)
 	{
+		if (requestType() == SNMP_GETNEXT)
+		{
+			return resolveNext();
+		}
+		if (requestType() == SNMP_GETBULK)
+		{
+			return requestBulk();
+		}
 		return SNMP_API_STAT_SUCCESS;
 	} 
 		arduAgent.generateErrorPDU(authenticated);	
@@ -287,24 +425,84 @@ SNMP_API_STAT_CODES arduAgentClass::requestPdu(){
  *
  *****************************************************************************/
 	void arduAgentClass::createResponsePDU(int respondValue){
-	int lsb = (respondValue >> (8*0)) & 0xff;
-	int slsb = (respondValue >> (8*1)) & 0xff;
-	int smsb = (respondValue >> (8*2)) & 0xff;
-	int msb = (respondValue >> (8*3)) & 0xff;
-	unsigned int baseResponseAddress = 7+lengthCommunityName+16+oidLength+requestIDlength;
-	unsigned int total_len = 8+lengthCommunityName+16+oidLength+requestIDlength+5;
-	_packet[7+lengthCommunityName] = 0xa2;	//Response
-	_packet[baseResponseAddress] = 0x02;	//Integer
-	_packet[baseResponseAddress+1] = 0x04;	//Length
-	_packet[baseResponseAddress+2] = (uint8_t) msb;
-	_packet[baseResponseAddress+3] = (uint8_t) smsb;
-	_packet[baseResponseAddress+4] = (uint8_t) slsb;
-	_packet[baseResponseAddress+5] = (uint8_t) lsb;
-	_packet[1] = total_len-2;	//Null bytes not included in response
+	respondInteger(respondValue);
+}
+
+/**************************************************************************//**
+ * Function: respondInteger
+ *
+ * Description:
+ * Builds and sends the integer response for createResponsePDU. Takes a
+ * 32 bit value so the agent's own values aren't cut short on boards
+ * where int is 16 bits.
+ * 
+ *
+ * Parameters: 
+ * int32_t respondValue - The integer to send to the client.
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void arduAgentClass::respondInteger(int32_t respondValue){
+	respondNumber(0x02, (uint32_t) respondValue, 4);	//Integer
+}
+
+/**************************************************************************//**
+ * Function: respondGauge
+ *
+ * Description:
+ * Builds and sends a Gauge32 response, for unsigned 32 bit values that
+ * an INTEGER can't hold. A leading 0 byte is added when the top bit is
+ * set, so the value isn't read as negative.
+ *
+ * Parameters: 
+ * uint32_t respondValue - The value to send to the client.
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void arduAgentClass::respondGauge(uint32_t respondValue){
+	byte length = 1;
+	while (length < 5 && (respondValue >> (8*length - 1)) != 0)
+	{
+		length++;
+	}
+	respondNumber(0x42, respondValue, length);	//Gauge32
+}
+
+/**************************************************************************//**
+ * Function: respondNumber
+ *
+ * Description:
+ * Puts a number in place of the received value, fixes up the lengths
+ * around it and sends the response.
+ *
+ * Parameters: 
+ * byte tag - The value's type
+ * uint32_t respondValue - The value, written big endian
+ * byte length - Number of bytes to write, up to 5 (the 5th is a 0)
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void arduAgentClass::respondNumber(byte tag, uint32_t respondValue, byte length){
+	unsigned int baseResponseAddress = _pduOffset+16+oidLength+requestIDlength;
+	_packet[_pduOffset] = 0xa2;	//Response
+	_packet[baseResponseAddress] = tag;
+	_packet[baseResponseAddress+1] = length;
+	for (int i = 0; i < length; i++)
+	{
+		int shift = 8 * (length - 1 - i);
+		_packet[baseResponseAddress+2+i] = (shift < 32) ? (uint8_t) (respondValue >> shift) : 0;
+	}
 	//Recalculate packet lengths:
-	_packet[7+lengthCommunityName+1] = _packet[7+lengthCommunityName+1]+4;
-	_packet[7+lengthCommunityName+11+requestIDlength] = 10+oidLength;
-	_packet[7+lengthCommunityName+13+requestIDlength] = 8+oidLength;
+	_packet[1] = _pduOffset+16+oidLength+requestIDlength+length;
+	_packet[_pduOffset+1] = 16+oidLength+requestIDlength+length;
+	_packet[_pduOffset+11+requestIDlength] = 6+oidLength+length;
+	_packet[_pduOffset+13+requestIDlength] = 4+oidLength+length;
 	arduAgent.send_response();	//Transmit the get response
 }
 
@@ -326,10 +524,10 @@ SNMP_API_STAT_CODES arduAgentClass::requestPdu(){
  *
  *****************************************************************************/
 void arduAgentClass::createResponsePDU(char respondValue[]){
-		unsigned short int baseResponseAddress = 7+lengthCommunityName+16+oidLength+requestIDlength;
+		unsigned short int baseResponseAddress = _pduOffset+16+oidLength+requestIDlength;
 		unsigned short int stringLength = strlen(respondValue);
-		unsigned short int total_len = 8+lengthCommunityName+16+oidLength+requestIDlength+1;
-		_packet[7+lengthCommunityName] = 0xa2;	//Response code
+		unsigned short int total_len = _pduOffset+17+oidLength+requestIDlength+1;
+		_packet[_pduOffset] = 0xa2;	//Response code
 		_packet[baseResponseAddress] = 0x04;	//Octet Stream Format
 		_packet[baseResponseAddress+1] = stringLength;
 		for (int i=0; i<stringLength;i++)
@@ -337,12 +535,12 @@ void arduAgentClass::createResponsePDU(char respondValue[]){
 			//Build response
 			total_len++;
 			_packet[baseResponseAddress+1+(i+1)] = respondValue[i];
-			_packet[7+lengthCommunityName+1] = _packet[7+lengthCommunityName+1]+1;
 		}
 		//Recalculate packet lengths
+		_packet[_pduOffset+1] = 16+oidLength+requestIDlength+stringLength;
 		_packet[1] = total_len-2;
-		_packet[7+lengthCommunityName+11+requestIDlength] = 6+oidLength+stringLength;
-		_packet[7+lengthCommunityName+13+requestIDlength] = 4+oidLength+stringLength;
+		_packet[_pduOffset+11+requestIDlength] = 6+oidLength+stringLength;
+		_packet[_pduOffset+13+requestIDlength] = 4+oidLength+stringLength;
 		arduAgent.send_response();
 }
 
@@ -363,7 +561,7 @@ void arduAgentClass::createResponsePDU(char respondValue[]){
  *
  *****************************************************************************/
 void arduAgentClass::generateErrorPDU(SNMP_ERR_CODES CODE){
-	unsigned short int errorCodeLocation = 7+lengthCommunityName+6+requestIDlength;
+	unsigned short int errorCodeLocation = _pduOffset+6+requestIDlength;
 	if (CODE==SNMP_ERR_TOO_BIG)
 	{
 		_packet[errorCodeLocation] = 0x01;
@@ -384,11 +582,19 @@ void arduAgentClass::generateErrorPDU(SNMP_ERR_CODES CODE){
 	{
 		_packet[errorCodeLocation] = 0x05;
 	}
+	else if (CODE==SNMP_ERR_WRONG_TYPE)
+	{
+		_packet[errorCodeLocation] = 0x07;
+	}
+	else if (CODE==SNMP_ERR_WRONG_LENGTH)
+	{
+		_packet[errorCodeLocation] = 0x08;
+	}
 	else if (CODE==SNMP_ERR_AUTHORIZATION_ERROR)
 	{
 		_packet[errorCodeLocation] = 0x10;
 	}
-	_packet[7+lengthCommunityName] = 0xa2;
+	_packet[_pduOffset] = 0xa2;
 	arduAgent.send_response();
 }
 
@@ -396,28 +602,26 @@ void arduAgentClass::generateErrorPDU(SNMP_ERR_CODES CODE){
  * Function: getOID
  *
  * Description:
- * This function returns the OID stored in private data.
+ * This function copies out the received OID, BER encoded.
  *
  * Parameters: 
- * byte input[] - A string into which the OID will be copied
+ * byte input[] - A string into which the OID will be copied, at least
+ *		getOIDlength() bytes long
  *
  * Returns:
  * None
  *
  *****************************************************************************/
 void arduAgentClass::getOID(byte input[]){
-	for (int i = 0; i < (int)oidLength; i++)
-	{
-		input[i] = oid[i];
-	}
+	memcpy(input, receivedOID(), oidLength);
 }
 
 /**************************************************************************//**
  * Function: getOIDlength
  *
  * Description:
- * This function returns the length of the OID that was last received.
- * (The one stored in private data)
+ * This function returns the length of the OID that was last received,
+ * in encoded bytes.
  *
  * Parameters: 
  * None
@@ -436,27 +640,161 @@ int arduAgentClass::getOIDlength(void){
  *
  * Description:
  * This function checks the OID in the received packet against the
- * OID that's passed in as a null terminated string. This is used
- * in the user's program to send the correct response based on the
- * OID's they have defined.
+ * encoded OID that's passed in. This is used in the user's program to
+ * send the correct response based on the OID's they have defined.
+ * Arrays declared with their size can be passed without the length.
  *
  * Parameters: 
- * None
+ * const byte inputoid[] - The encoded OID, see SNMP_ARC2/SNMP_ARC3
+ * byte length - Number of bytes in inputoid
+ *
+ * Returns:
+ * false - OID didn't match
+ * true - OID matched
+ *
+ *****************************************************************************/
+bool arduAgentClass::checkOID(const byte inputoid[], byte length){
+	return length == oidLength && memcmp(inputoid, receivedOID(), length) == 0;
+}
+
+/**************************************************************************//**
+ * Function: encodeArc
+ *
+ * Description:
+ * Writes one sub-identifier in base 128, high group first.
+ *
+ * Parameters: 
+ * uint32_t arc - The sub-identifier
+ * byte encoded[] - Receives up to SNMP_MAX_ARC_LEN bytes
+ *
+ * Returns:
+ * byte - Number of bytes written
+ *****************************************************************************/
+static byte encodeArc(uint32_t arc, byte encoded[]){
+	byte length = 1;
+	while (length < SNMP_MAX_ARC_LEN && (arc >> (7 * length)) != 0)
+	{
+		length++;
+	}
+	for (int i = 0; i < length; i++)
+	{
+		byte group = (arc >> (7 * (length - 1 - i))) & 0x7f;
+		encoded[i] = (i == length - 1) ? group : (group | 0x80);
+	}
+	return length;
+}
+
+/**************************************************************************//**
+ * Function: arcLength
+ *
+ * Description:
+ * Finds the length of the encoded sub-identifier starting at encoded[0].
+ *
+ * Parameters: 
+ * const byte encoded[] - The encoded sub-identifier
+ * byte length - Bytes left in the OID
+ *
+ * Returns:
+ * byte - Number of bytes in the sub-identifier (at most length)
+ *****************************************************************************/
+static byte arcLength(const byte encoded[], byte length){
+	byte i = 0;
+	while (i < length && (encoded[i] & 0x80))
+	{
+		i++;
+	}
+	return (i < length) ? i + 1 : length;
+}
+
+/**************************************************************************//**
+ * Function: decodeArc
+ *
+ * Description:
+ * Reads one sub-identifier written by encodeArc.
+ *
+ * Parameters: 
+ * const byte encoded[] - The encoded sub-identifier
+ * byte length - Bytes left in the OID
+ * uint32_t & arc - Receives the sub-identifier
+ *
+ * Returns:
+ * byte - Number of bytes read
+ *****************************************************************************/
+static byte decodeArc(const byte encoded[], byte length, uint32_t & arc){
+	byte used = arcLength(encoded, length);
+	arc = 0;
+	for (int i = 0; i < used; i++)
+	{
+		arc = (arc << 7) | (encoded[i] & 0x7f);
+	}
+	return used;
+}
+
+/**************************************************************************//**
+ * Function: checkOID (Integer arcs)
+ *
+ * Description:
+ * Deprecated form of checkOID taking a pointer to one int per arc. As the
+ * array's size isn't known, it matches when the received OID is a prefix
+ * of inputoid, and reads inputoid as far as the received OID goes, which
+ * can be past its end. Pass the array itself so the sized form is used.
+ *
+ * Parameters: 
+ * const volatile int inputoid[] - The OID, one arc per entry
+ *
+ * Returns:
+ * false - OID didn't match
+ * true - OID matched
+ *
+ *****************************************************************************/
+bool arduAgentClass::checkOID(const volatile int inputoid[]){
+	return matchArcs(inputoid, 0);
+}
+
+/**************************************************************************//**
+ * Function: matchArcs
+ *
+ * Description:
+ * Compares the received OID with one given as one int per arc. The arcs
+ * are encoded as they're compared. Arcs above 32767 can't be held in an
+ * int on AVR, use the encoded form for those.
+ *
+ * Parameters: 
+ * const volatile int arcs[] - The OID, one arc per entry
+ * size_t count - Number of arcs, all of which must match. 0 if unknown,
+ *                for the deprecated pointer form of checkOID.
  *
  * Returns:
  * false - OID didn't match
  * true - OID matched
  *
  *****************************************************************************/
-bool arduAgentClass::checkOID(const int inputoid[]){
-	for(int i = 2; i < oidLength; i++)
+bool arduAgentClass::matchArcs(const volatile int arcs[], size_t count){
+	const byte *received = receivedOID();
+	byte encoded[SNMP_MAX_ARC_LEN];
+	byte used;
+	byte pos = 0;
+	size_t i = 2;
+	if (oidLength == 0 || count == 1)
+	{
+		return false;
+	}
+	// First two arcs share a byte
+	used = encodeArc((unsigned int) (arcs[0] * 40 + arcs[1]), encoded);
+	while (pos + used <= oidLength && memcmp(encoded, received + pos, used) == 0)
 	{
-		if(inputoid[i] != oid[i-1])
+		pos += used;
+		if (pos == oidLength)
 		{
-			return false;
+			return count == 0 || i == count;
+		}
+		if (i == count)
+		{
+			return false;	//Received OID is longer
 		}
+		used = encodeArc((unsigned int) arcs[i++], encoded);
 	}
-	return true;
+	return false;
 }
 
 /**************************************************************************//**
@@ -471,14 +809,30 @@ bool arduAgentClass::checkOID(const int inputoid[]){
  * Returns:
  * SNMP_API_CODES SNMP_API_STAT_SUCCESS - No error (sent)
  * SNMP_API_CODES SNMP_API_STAT_PACKET_INVALID - bad packet (not sent)
+ * SNMP_API_CODES SNMP_API_STAT_PACKET_TOO_BIG - SNMPv3 response doesn't fit
  *
  *****************************************************************************/
 SNMP_API_STAT_CODES arduAgentClass::send_response(void){
-	if(!Udp.beginPacket(Udp.remoteIP(), Udp.remotePort()))
+	uint16_t length = _packet[1]+2;
+	if (length > SNMP_MAX_PACKET_LEN)
+	{
+		return SNMP_API_STAT_PACKET_INVALID;
+	}
+#if SNMP_USM
+	if (_usmRequest)
+	{
+		length = finalizeUsm();
+		if (length == 0)
+		{
+			return SNMP_API_STAT_PACKET_TOO_BIG;
+		}
+	}
+#endif
+	if(!Udp.beginPacket(IPAddress(_dstIp[0], _dstIp[1], _dstIp[2], _dstIp[3]), _dstPort))
 	{
 		return SNMP_API_STAT_PACKET_INVALID;
 	}
-	Udp.write(_packet, _packet[1]+2);
+	Udp.write(_packet, length);
 	Udp.endPacket();
 	return SNMP_API_STAT_SUCCESS;
 }
@@ -511,7 +865,8 @@ void arduAgentClass::print_packet(void){
  *
  * Description:
  * This function verifies the appropriate community name by calling 
- * authenticateGetCommunity or authenticateSetCommunity.
+ * authenticateGetCommunity or authenticateSetCommunity. SNMPv3 requests
+ * have no community, the USM user was already authenticated.
  *
  * Parameters: 
  * None
@@ -522,12 +877,18 @@ void arduAgentClass::print_packet(void){
  *****************************************************************************/
 SNMP_ERR_CODES arduAgentClass::generalAuthenticator(void){
 	SNMP_ERR_CODES authd = SNMP_ERR_NO_ERROR;
-	if (request[0] == 0xa0)
+#if SNMP_USM
+	if (_usmRequest)
 	{
-		// Request was a GET request - Call authenticator
+		return SNMP_ERR_NO_ERROR;
+	}
+#endif
+	if (request[0] == 0xa0 || request[0] == 0xa1 || request[0] == 0xa5)
+	{
+		// Request was a GET, GETNEXT or GETBULK request - Call authenticator
 		authd = authenticateGetCommunity();
 	}
-	else //Result was not a GET request. SET is the only other implemented type
+	else //Result was not a read request. SET is the only other implemented type
 	authd = authenticateSetCommunity();//Call Authenticator
 	
 	return authd;
@@ -620,16 +981,70 @@ SNMP_ERR_CODES arduAgentClass::authenticateSetCommunity(void){
  *
  * Returns:
  * SNMP_REQUEST TYPES SNMP_GET (0xa0) request was a GET
+ * SNMP_REQUEST TYPES SNMP_GETNEXT (0xa1) request was a GETNEXT
  * SNMP_REQUEST TYPES SNMP_SET (0xa3) request was a SET
+ * SNMP_REQUEST TYPES SNMP_GETBULK (0xa5) request was a GETBULK
  *****************************************************************************/
 SNMP_REQUEST_TYPES arduAgentClass::requestType(void){
 	if (request[0] == 0xa3){
 		//Request was a SET request
 		return SNMP_SET;
 	}
+	else if (request[0] == 0xa1){
+		return SNMP_GETNEXT;
+	}
+	else if (request[0] == 0xa5){
+		return SNMP_GETBULK;
+	}
 	else return SNMP_GET;
 }
 
+/**************************************************************************//**
+ * Function: receivedInteger
+ *
+ * Description:
+ * This function decodes the INTEGER a SET request carries (big endian,
+ * two's complement, 1 to sizeof(int) bytes). Both set() functions go
+ * through here. A value of the wrong type or one too long for an int
+ * is answered with an error: badValue for SNMPv1, wrongType or
+ * wrongLength for SNMPv2c/v3.
+ *
+ * Parameters: 
+ * int & value - Receives the integer
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - No error
+ * SNMP_API_STAT_CODES SNMP_API_STAT_PACKET_INVALID - Wrong type or length
+ *		(already answered)
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::receivedInteger(int & value){
+	uint16_t pos = _pduOffset+16+oidLength+requestIDlength;
+	byte length = _packet[pos+1];
+	SNMP_ERR_CODES error = SNMP_ERR_NO_ERROR;
+	if (_packet[pos] != 0x02)
+	{
+		error = (version[2] != 0) ? SNMP_ERR_WRONG_TYPE : SNMP_ERR_BAD_VALUE;
+	}
+	else if (length == 0 || length > sizeof(int) || pos + 2 + length > _packetSize)
+	{
+		error = (version[2] != 0) ? SNMP_ERR_WRONG_LENGTH : SNMP_ERR_BAD_VALUE;
+	}
+	if (error != SNMP_ERR_NO_ERROR)
+	{
+		_packet[_pduOffset+9+requestIDlength] = 1;	// error-index: the varbind
+		generateErrorPDU(error);
+		return SNMP_API_STAT_PACKET_INVALID;
+	}
+	// Sign extend from the first byte, then shift the rest in
+	uint32_t decoded = (_packet[pos+2] & 0x80) ? 0xFFFFFFFF : 0;
+	for (int i = 0; i < length; i++)
+	{
+		decoded = (decoded << 8) | _packet[pos+2+i];
+	}
+	value = (int) (int32_t) decoded;
+	return SNMP_API_STAT_SUCCESS;
+}
+
 /**************************************************************************//**
  * Function: set (Integer)
  *
@@ -642,19 +1057,1455 @@ SNMP_REQUEST_TYPES arduAgentClass::requestType(void){
  *
  * Returns:
  * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - No error
- * SNMP_API_STAT_CODES SNMP_API_STAT_PACKET_INVALID - Data type incorrect
+ * SNMP_API_STAT_CODES SNMP_API_STAT_PACKET_INVALID - Data type or length
+ *		incorrect (already answered)
  *****************************************************************************/
 SNMP_API_STAT_CODES arduAgentClass::set(int & reqValue){
-	
-	if (_packet[7+lengthCommunityName+16+(int) oidLength+requestIDlength]==0x02)
+	SNMP_API_STAT_CODES status = receivedInteger(reqValue);
+	if (status == SNMP_API_STAT_SUCCESS)
 	{
-	reqValue = setValueInt;
-	createResponsePDU(reqValue);
-	return SNMP_API_STAT_SUCCESS;
+		createResponsePDU(reqValue);
+	}
+	return status;
+}
+
+/**************************************************************************//**
+ * Function: set (Integer value cell)
+ *
+ * Description:
+ * This function sets the value cell passed into it using the integer
+ * received over the network. The SET counts as the cell's writer, so an
+ * interrupt must not also write to a cell the manager can set.
+ *
+ * Parameters: 
+ * snmpValueCell<int> & reqValue - The user's program variable that they
+ *		want set
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - No error
+ * SNMP_API_STAT_CODES SNMP_API_STAT_PACKET_INVALID - Data type or length
+ *		incorrect (already answered)
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::set(snmpValueCell<int> & reqValue){
+	int value;
+	SNMP_API_STAT_CODES status = receivedInteger(value);
+	if (status == SNMP_API_STAT_SUCCESS)
+	{
+		reqValue.write(value);
+		createResponsePDU(value);
+	}
+	return status;
+}
+
+/**************************************************************************//**
+ * Function: compareEncoded
+ *
+ * Description:
+ * This function compares two encoded OIDs in lexicographic (MIB) order.
+ * Where one is a prefix of the other, or the sub-identifiers where they
+ * first differ are the same length, memcmp gives the order directly.
+ * Otherwise the sub-identifier with more bytes is the bigger one, which
+ * a byte compare would get wrong (e.g. .200 is 0x81,0x48 but .3 is 0x03).
+ *
+ * Parameters: 
+ * const byte a[] - The first OID
+ * byte aLength - Number of bytes in a
+ * const byte b[] - The second OID
+ * byte bLength - Number of bytes in b
+ *
+ * Returns:
+ * int < 0, 0, > 0 - a comes before, is the same as, or comes after b
+ *****************************************************************************/
+static int compareEncoded(const byte a[], byte aLength, const byte b[], byte bLength){
+	byte common = (aLength < bLength) ? aLength : bLength;
+	int result = memcmp(a, b, common);
+	if (result == 0)
+	{
+		return aLength - bLength;
 	}
-	else return SNMP_API_STAT_PACKET_INVALID;
+	// Find the start of the sub-identifier holding the first difference
+	byte start = 0;
+	for (byte i = 0; a[i] == b[i]; i++)
+	{
+		if (!(a[i] & 0x80))
+		{
+			start = i + 1;
+		}
+	}
+	byte aArc = arcLength(a + start, aLength - start);
+	byte bArc = arcLength(b + start, bLength - start);
+	if (aArc != bArc)
+	{
+		return aArc - bArc;
+	}
+	return result;
 }
 
+/**************************************************************************//**
+ * Function: setMib
+ *
+ * Description:
+ * Gives the agent the list of OIDs the user's program answers for, so it
+ * can work out the successor for GETNEXT requests. The list must be in
+ * ascending OID order and stay in scope for as long as the agent runs.
+ * Any remembered walk positions are forgotten.
+ *
+ * Parameters: 
+ * const snmpMibEntry mib[] - The encoded OIDs, in ascending order
+ * byte count - Number of entries in mib
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - No error
+ * SNMP_API_STAT_CODES SNMP_API_STAT_OID_TOO_BIG - An OID is too long
+ * SNMP_API_STAT_CODES SNMP_API_STAT_MIB_UNORDERED - Entries out of order
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::setMib(const snmpMibEntry mib[], byte count){
+	for (int i = 0; i < count; i++)
+	{
+		if (mib[i].length == 0 || mib[i].length > SNMP_MAX_OID_LEN)
+		{
+			return SNMP_API_STAT_OID_TOO_BIG;
+		}
+		if (i > 0 && compareEncoded(mib[i].oid, mib[i].length, mib[i-1].oid, mib[i-1].length) <= 0)
+		{
+			return SNMP_API_STAT_MIB_UNORDERED;
+		}
+	}
+	_mib = mib;
+	_mibCount = count;
+	for (int i = 0; i < SNMP_WALK_CURSORS; i++)
+	{
+		_cursors[i].valid = false;
+	}
+	return SNMP_API_STAT_SUCCESS;
+}
+
+/**************************************************************************//**
+ * Function: compareOID
+ *
+ * Description:
+ * This function compares the OID in the received packet with the one
+ * passed in, in lexicographic (MIB) order.
+ *
+ * Parameters: 
+ * const byte oid[] - The encoded OID to compare against
+ * byte length - Number of bytes in oid
+ *
+ * Returns:
+ * int < 0 - Received OID comes first
+ * int 0 - OIDs are the same
+ * int > 0 - Received OID comes after
+ *****************************************************************************/
+int arduAgentClass::compareOID(const byte oid[], byte length){
+	return compareEncoded(receivedOID(), oidLength, oid, length);
+}
+
+/**************************************************************************//**
+ * Function: receivedOID
+ *
+ * Description:
+ * This function returns where the encoded OID of the received packet
+ * is. It's oidLength bytes long.
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * const byte * - The OID, inside _packet
+ *****************************************************************************/
+const byte *arduAgentClass::receivedOID(void){
+	return _packet + _pduOffset + 16 + requestIDlength;
+}
+
+/**************************************************************************//**
+ * Function: encodeOID
+ *
+ * Description:
+ * This function encodes an OID given as one number per arc, e.g. to
+ * build an OID at run time that can be passed to checkOID.
+ *
+ * Parameters: 
+ * const uint32_t arcs[] - The OID, at least 2 arcs
+ * byte count - Number of arcs
+ * byte encoded[] - Receives the OID, up to SNMP_MAX_OID_LEN bytes
+ *
+ * Returns:
+ * byte - Number of bytes written, 0 if the OID is invalid or too long
+ *****************************************************************************/
+byte arduAgentClass::encodeOID(const uint32_t arcs[], byte count, byte encoded[]){
+	byte arc[SNMP_MAX_ARC_LEN];
+	byte length = 0;
+	if (count < SNMP_MIN_OID_LEN || arcs[0] > 2 || (arcs[0] < 2 && arcs[1] >= 40))
+	{
+		return 0;
+	}
+	for (int i = 1; i < count; i++)
+	{
+		// First two arcs share a sub-identifier
+		byte used = encodeArc((i == 1) ? arcs[0] * 40 + arcs[1] : arcs[i], arc);
+		if (length + used > SNMP_MAX_OID_LEN)
+		{
+			return 0;
+		}
+		memcpy(encoded + length, arc, used);
+		length += used;
+	}
+	return length;
+}
+
+/**************************************************************************//**
+ * Function: decodeOID
+ *
+ * Description:
+ * This function turns an encoded OID (such as the one from getOID) back
+ * into one number per arc.
+ *
+ * Parameters: 
+ * const byte encoded[] - The encoded OID
+ * byte length - Number of bytes in encoded
+ * uint32_t arcs[] - Receives the arcs
+ * byte maxArcs - Room in arcs
+ *
+ * Returns:
+ * byte - Number of arcs, 0 if the OID is empty or arcs is too small
+ *****************************************************************************/
+byte arduAgentClass::decodeOID(const byte encoded[], byte length, uint32_t arcs[], byte maxArcs){
+	byte count = 0;
+	byte pos = 0;
+	uint32_t arc;
+	if (length == 0 || maxArcs < SNMP_MIN_OID_LEN)
+	{
+		return 0;
+	}
+	pos = decodeArc(encoded, length, arc);
+	arcs[0] = (arc < 80) ? arc / 40 : 2;
+	arcs[1] = arc - arcs[0] * 40;
+	count = 2;
+	while (pos < length)
+	{
+		if (count >= maxArcs)
+		{
+			return 0;
+		}
+		pos += decodeArc(encoded + pos, length - pos, arcs[count++]);
+	}
+	return count;
+}
+
+/**************************************************************************//**
+ * Function: resolveNext
+ *
+ * Description:
+ * Replaces the OID of a GETNEXT request with the next OID in the MIB.
+ * Each manager's last position is kept in a small table, so when a walk
+ * asks for the entry it was just given the successor is the next entry
+ * and no search is needed. Otherwise the MIB is binary searched.
+ * Rows of any samplers are walked as well.
+ * When there is no successor the end of the MIB is reported to the
+ * manager (noSuchName for SNMPv1, endOfMibView for SNMPv2c).
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - OID replaced
+ * SNMP_API_STAT_CODES SNMP_API_STAT_NO_SUCH_NAME - End of MIB (answered)
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::resolveNext(void){
+	snmpWalkCursor *cursor = NULL;
+	int next = -1;
+	for (int i = 0; i < SNMP_WALK_CURSORS; i++)
+	{
+		if (_cursors[i].valid && _cursors[i].port == _dstPort &&
+			memcmp(_cursors[i].ip, _dstIp, 4) == 0)
+		{
+			cursor = &_cursors[i];
+			break;
+		}
+	}
+	if (cursor != NULL && cursor->index < _mibCount &&
+		checkOID(_mib[cursor->index].oid, _mib[cursor->index].length))
+	{
+		// Walk is continuing from where we left off
+		next = cursor->index + 1;
+	}
+	else
+	{
+		// Find the first entry after the received OID
+		int low = 0;
+		int high = _mibCount;
+		while (low < high)
+		{
+			int mid = (low + high) / 2;
+			if (compareOID(_mib[mid].oid, _mib[mid].length) < 0) high = mid;
+			else low = mid + 1;
+		}
+		next = low;
+	}
+	// A sampler row may come before the MIB entry
+	byte best[SNMP_MAX_SAMPLER_ROW];
+	byte bestLength = 0;
+	for (int i = 0; i < _samplerCount; i++)
+	{
+		byte row[SNMP_MAX_SAMPLER_ROW];
+		byte rowLength;
+		if (samplerNext(*_samplers[i], row, rowLength) &&
+			(bestLength == 0 || compareEncoded(row, rowLength, best, bestLength) < 0))
+		{
+			memcpy(best, row, rowLength);
+			bestLength = rowLength;
+		}
+	}
+	if (bestLength != 0 && (next >= _mibCount ||
+		compareEncoded(best, bestLength, _mib[next].oid, _mib[next].length) < 0))
+	{
+		rewriteOID(best, bestLength);
+		return SNMP_API_STAT_SUCCESS;
+	}
+	if (next >= _mibCount)
+	{
+		if (cursor != NULL)
+		{
+			cursor->valid = false;
+		}
+		if (version[2] != 0)
+		{
+			// SNMPv2c/v3: endOfMibView in place of the NULL value
+			_packet[_pduOffset+16+oidLength+requestIDlength] = 0x82;
+			_packet[_pduOffset] = 0xa2;
+			send_response();
+		}
+		else
+		{
+			// SNMPv1: noSuchName, pointing at the (only) varbind
+			_packet[_pduOffset+9+requestIDlength] = 1;
+			generateErrorPDU(SNMP_ERR_NO_SUCH_NAME);
+		}
+		return SNMP_API_STAT_NO_SUCH_NAME;
+	}
+	if (cursor == NULL)
+	{
+		// Only take a slot (maybe another manager's) when there's a position to keep
+		cursor = &_cursors[_nextCursor];
+		_nextCursor = (_nextCursor + 1) % SNMP_WALK_CURSORS;
+		memcpy(cursor->ip, _dstIp, 4);
+		cursor->port = _dstPort;
+	}
+	cursor->index = next;
+	cursor->valid = true;
+	rewriteOID(_mib[next].oid, _mib[next].length);
+	return SNMP_API_STAT_SUCCESS;
+}
+
+/**************************************************************************//**
+ * Function: rewriteOID
+ *
+ * Description:
+ * Replaces the OID in the received packet with the one passed in and
+ * fixes up the lengths that contain it, so the response functions build
+ * the answer for the new OID.
+ *
+ * Parameters: 
+ * const byte oid[] - The new encoded OID
+ * byte length - Number of bytes in oid
+ *
+ * Returns:
+ * None
+ *****************************************************************************/
+void arduAgentClass::rewriteOID(const byte oid[], byte length){
+	unsigned short int oidBaseAddress = _pduOffset+16+requestIDlength;
+	int delta = length - oidLength;
+	memcpy(_packet + oidBaseAddress, oid, length);
+	oidLength = length;
+	_packet[oidBaseAddress-1] = oidLength;
+	_packet[oidBaseAddress+oidLength] = 0x05;	//NULL value
+	_packet[oidBaseAddress+oidLength+1] = 0x00;
+	//Recalculate packet lengths
+	_packet[1] += delta;
+	_packet[_pduOffset+1] += delta;
+	_packet[_pduOffset+11+requestIDlength] += delta;
+	_packet[_pduOffset+13+requestIDlength] += delta;
+}
+/**************************************************************************//**
+ * Function: addSampler
+ *
+ * Description:
+ * Registers a function the agent calls every interval milliseconds from
+ * listen(). The last SNMP_HISTORY_LEN results are kept in a ring buffer
+ * in the snmpSampler passed in,
+ * along with their minimum, maximum and mean, and are answered under the
+ * base OID passed in:
+ *   base.1.0 last, base.2.0 min, base.3.0 max, base.4.0 mean,
+ *   base.5.0 number of samples held,
+ *   base.6.N history, N = the sample's number, counting from 1 for the
+ *   first one taken. Only the newest SNMP_HISTORY_LEN are held, so a walk
+ *   sees the same N for a sample however many are taken during it.
+ * A GETBULK of the rows is answered by the agent with many rows at once.
+ * The sampler and base OID must stay in scope for as long as the agent
+ * runs, and the base OID should not overlap any OID passed to setMib().
+ *
+ * Parameters: 
+ * snmpSampler & sampler - Storage for the samples
+ * const byte oid[] - Encoded base OID for the rows
+ * byte length - Number of bytes in oid
+ * snmpSampleSource source - Function returning the current value
+ * uint32_t interval - Milliseconds between samples
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - No error
+ * SNMP_API_STAT_CODES SNMP_API_STAT_MALLOC_ERR - SNMP_MAX_SAMPLERS reached
+ * SNMP_API_STAT_CODES SNMP_API_STAT_OID_TOO_BIG - Base OID too long
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::addSampler(snmpSampler & sampler, const byte oid[], byte length, snmpSampleSource source, uint32_t interval){
+	if (_samplerCount >= SNMP_MAX_SAMPLERS)
+	{
+		return SNMP_API_STAT_MALLOC_ERR;
+	}
+	if (length == 0 || length > SNMP_MAX_SAMPLER_OID)
+	{
+		return SNMP_API_STAT_OID_TOO_BIG;
+	}
+	_samplers[_samplerCount++] = &sampler;
+	sampler.oid = oid;
+	sampler.oidLength = length;
+	sampler.source = source;
+	sampler.interval = interval;
+	sampler.lastSample = millis() - interval;	// First sample on next listen()
+	sampler.head = SNMP_HISTORY_LEN - 1;	// First sample goes in slot 0
+	sampler.count = 0;
+	sampler.taken = 0;
+	sampler.sum = 0;
+	sampler.min = 0;
+	sampler.max = 0;
+	sampler.mean = 0;
+	return SNMP_API_STAT_SUCCESS;
+}
+
+/**************************************************************************//**
+ * Function: rescanSampler
+ *
+ * Description:
+ * Works out the minimum and maximum of a sampler from its whole history.
+ *
+ * Parameters: 
+ * snmpSampler & sampler - The sampler to update
+ *
+ * Returns:
+ * None
+ *****************************************************************************/
+static void rescanSampler(snmpSampler & sampler){
+	sampler.min = sampler.history[sampler.head];
+	sampler.max = sampler.history[sampler.head];
+	for (int j = 0; j < sampler.count; j++)
+	{
+		int32_t value = sampler.history[j];
+		if (value < sampler.min) sampler.min = value;
+		if (value > sampler.max) sampler.max = value;
+	}
+}
+
+/**************************************************************************//**
+ * Function: runSamplers
+ *
+ * Description:
+ * Takes a sample from each source that is due and updates its running
+ * total, minimum, maximum and mean, so reading them is just a lookup.
+ * The history is only rescanned when the sample dropping out of the
+ * window was the minimum or maximum and the new one doesn't replace it.
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * None
+ *****************************************************************************/
+void arduAgentClass::runSamplers(void){
+	uint32_t now = millis();
+	for (int i = 0; i < _samplerCount; i++)
+	{
+		snmpSampler & sampler = *_samplers[i];
+		if (now - sampler.lastSample < sampler.interval)
+		{
+			continue;
+		}
+		// Keep to a fixed rate, unless we've fallen more than a sample behind
+		sampler.lastSample += sampler.interval;
+		if (now - sampler.lastSample >= sampler.interval)
+		{
+			sampler.lastSample = now;
+		}
+		int32_t value = (*sampler.source)();
+		bool full = (sampler.count == SNMP_HISTORY_LEN);
+		bool rescan = false;
+		sampler.head = (sampler.head + 1) % SNMP_HISTORY_LEN;
+		int32_t oldest = sampler.history[sampler.head];	// Only valid when full
+		sampler.history[sampler.head] = value;
+		sampler.taken++;
+		if (full)
+		{
+			sampler.sum -= oldest;
+		}
+		else
+		{
+			sampler.count++;
+		}
+		sampler.sum += value;
+		sampler.mean = sampler.sum / sampler.count;
+		if (sampler.count == 1)
+		{
+			sampler.min = value;
+			sampler.max = value;
+			continue;
+		}
+		if (value <= sampler.min) sampler.min = value;
+		else if (full && oldest == sampler.min) rescan = true;
+		if (value >= sampler.max) sampler.max = value;
+		else if (full && oldest == sampler.max) rescan = true;
+		if (rescan)
+		{
+			rescanSampler(sampler);
+		}
+	}
+}
+
+/**************************************************************************//**
+ * Function: msUntilNextSample
+ *
+ * Description:
+ * Returns how long until a sampler is next due, so the user's program
+ * knows how long it can sleep without delaying a sample.
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * uint32_t - Milliseconds until the next sample, 0 if one is due now,
+ *		0xFFFFFFFF if there are no samplers
+ *****************************************************************************/
+uint32_t arduAgentClass::msUntilNextSample(void){
+	uint32_t now = millis();
+	uint32_t wait = 0xFFFFFFFF;
+	for (int i = 0; i < _samplerCount; i++)
+	{
+		uint32_t elapsed = now - _samplers[i]->lastSample;
+		uint32_t remaining = (elapsed >= _samplers[i]->interval) ? 0 : _samplers[i]->interval - elapsed;
+		if (remaining < wait) wait = remaining;
+	}
+	return wait;
+}
+
+/**************************************************************************//**
+ * Function: samplerValue
+ *
+ * Description:
+ * Looks up the value of one row of a sampler.
+ *
+ * Parameters: 
+ * const snmpSampler & sampler - The sampler
+ * uint32_t column - The row's column, see SNMP_SAMPLER_COLUMNS
+ * uint32_t index - 0 for columns 1-5, the sample number for history
+ * int32_t & value - Receives the value
+ *
+ * Returns:
+ * true - Row exists, value set
+ * false - No such row (or no samples yet)
+ *****************************************************************************/
+static bool samplerValue(const snmpSampler & sampler, uint32_t column, uint32_t index, int32_t & value){
+	if (sampler.count == 0)
+	{
+		return false;
+	}
+	if (column == SNMP_SAMPLE_HISTORY)
+	{
+		// Sample number taken is in the head slot, older ones before it
+		if (index > sampler.taken || sampler.taken - index >= sampler.count)
+		{
+			return false;
+		}
+		value = sampler.history[(sampler.head + SNMP_HISTORY_LEN - (sampler.taken - index)) % SNMP_HISTORY_LEN];
+		return true;
+	}
+	if (index != 0)
+	{
+		return false;
+	}
+	switch (column)
+	{
+		case SNMP_SAMPLE_LAST:	value = sampler.history[sampler.head]; return true;
+		case SNMP_SAMPLE_MIN:	value = sampler.min; return true;
+		case SNMP_SAMPLE_MAX:	value = sampler.max; return true;
+		case SNMP_SAMPLE_MEAN:	value = sampler.mean; return true;
+		case SNMP_SAMPLE_COUNT:	value = sampler.count; return true;
+	}
+	return false;
+}
+
+/**************************************************************************//**
+ * Function: nextSamplerRow
+ *
+ * Description:
+ * Steps from one row of a sampler that exists to the next one, in OID
+ * order: columns 1-5, then the history rows still held, oldest first.
+ *
+ * Parameters: 
+ * const snmpSampler & sampler - The sampler
+ * uint32_t & column - The row's column, moved on to the next row's
+ * uint32_t & index - The row's index, moved on to the next row's
+ *
+ * Returns:
+ * true - column and index hold the next row
+ * false - That was the sampler's last row
+ *****************************************************************************/
+static bool nextSamplerRow(const snmpSampler & sampler, uint32_t & column, uint32_t & index){
+	uint32_t oldest = sampler.taken - sampler.count + 1;
+	if (column < SNMP_SAMPLE_COUNT)
+	{
+		column++;
+		return true;
+	}
+	if (column == SNMP_SAMPLE_COUNT)
+	{
+		column = SNMP_SAMPLE_HISTORY;
+		index = oldest;
+		return true;
+	}
+	if (index >= sampler.taken)
+	{
+		return false;
+	}
+	index = (index < oldest) ? oldest : index + 1;
+	return true;
+}
+
+/**************************************************************************//**
+ * Function: samplerRowOID
+ *
+ * Description:
+ * Builds the encoded OID of one row of a sampler.
+ *
+ * Parameters: 
+ * const snmpSampler & sampler - The sampler
+ * uint32_t column - The row's column
+ * uint32_t index - The row's index
+ * byte row[] - Receives the OID, SNMP_MAX_SAMPLER_ROW bytes long
+ *
+ * Returns:
+ * byte - Number of bytes in row
+ *****************************************************************************/
+static byte samplerRowOID(const snmpSampler & sampler, uint32_t column, uint32_t index, byte row[]){
+	byte length = sampler.oidLength;
+	memcpy(row, sampler.oid, length);
+	length += encodeArc(column, row + length);
+	length += encodeArc(index, row + length);
+	return length;
+}
+
+/**************************************************************************//**
+ * Function: findSamplerRow
+ *
+ * Description:
+ * Works out which sampler, column and index the received OID is a row
+ * of. The row itself may not exist, see samplerValue.
+ *
+ * Parameters: 
+ * uint32_t & column - Receives the column
+ * uint32_t & index - Receives the index
+ *
+ * Returns:
+ * const snmpSampler * - The sampler, NULL if the OID isn't under any
+ *****************************************************************************/
+const snmpSampler *arduAgentClass::findSamplerRow(uint32_t & column, uint32_t & index){
+	const byte *received = receivedOID();
+	for (int i = 0; i < _samplerCount; i++)
+	{
+		const snmpSampler & sampler = *_samplers[i];
+		byte pos = sampler.oidLength;
+		if (oidLength <= pos || memcmp(received, sampler.oid, pos) != 0)
+		{
+			continue;
+		}
+		pos += decodeArc(received + pos, oidLength - pos, column);
+		if (pos == oidLength)
+		{
+			continue;
+		}
+		pos += decodeArc(received + pos, oidLength - pos, index);
+		if (pos != oidLength)
+		{
+			continue;
+		}
+		return &sampler;
+	}
+	return NULL;
+}
+
+/**************************************************************************//**
+ * Function: respondSampler
+ *
+ * Description:
+ * If the received OID is one of the rows of a sampler (see addSampler),
+ * this function sends the value as the response. Call it from the user's
+ * GET handler before checking their own OIDs.
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * true - OID belonged to a sampler and the response was sent
+ * false - OID didn't belong to a sampler, nothing sent
+ *****************************************************************************/
+bool arduAgentClass::respondSampler(void){
+	uint32_t column;
+	uint32_t index;
+	int32_t value;
+	const snmpSampler *sampler = findSamplerRow(column, index);
+	if (sampler == NULL || !samplerValue(*sampler, column, index, value))
+	{
+		return false;
+	}
+	respondInteger(value);
+	return true;
+}
+
+/**************************************************************************//**
+ * Function: samplerNext
+ *
+ * Description:
+ * Works out the first row of a sampler that comes after the received OID,
+ * for GETNEXT.
+ *
+ * Parameters: 
+ * const snmpSampler & sampler - The sampler whose rows are checked
+ * byte row[] - Filled with the row's encoded OID, SNMP_MAX_SAMPLER_ROW
+ *		bytes long
+ * byte & rowLength - Set to the number of bytes in row
+ *
+ * Returns:
+ * true - row holds the successor
+ * false - No row of this sampler comes after the received OID
+ *****************************************************************************/
+bool arduAgentClass::samplerNext(const snmpSampler & sampler, byte row[], byte & rowLength){
+	// Rows that exist, in order: columns 1-5 then history by sample number
+	uint32_t column = SNMP_SAMPLE_LAST;
+	uint32_t index = 0;
+	const byte *received = receivedOID();
+	byte base = sampler.oidLength;
+	if (sampler.count == 0)
+	{
+		return false;
+	}
+	if (oidLength > base && memcmp(received, sampler.oid, base) == 0)
+	{
+		// Inside this sampler's subtree
+		uint32_t inColumn;
+		byte pos = base + decodeArc(received + base, oidLength - base, inColumn);
+		if (inColumn > SNMP_SAMPLE_HISTORY)
+		{
+			return false;
+		}
+		if (inColumn == SNMP_SAMPLE_HISTORY)
+		{
+			uint32_t inIndex = 0;
+			if (pos < oidLength)
+			{
+				decodeArc(received + pos, oidLength - pos, inIndex);
+			}
+			if (inIndex >= sampler.taken)
+			{
+				return false;
+			}
+			// Skip any that have dropped out of the buffer
+			column = SNMP_SAMPLE_HISTORY;
+			index = inIndex;
+			if (!nextSamplerRow(sampler, column, index))
+			{
+				return false;
+			}
+		}
+		else if (inColumn >= SNMP_SAMPLE_LAST)
+		{
+			column = inColumn;
+			if (pos != oidLength)
+			{
+				nextSamplerRow(sampler, column, index);
+			}
+		}
+	}
+	else if (compareOID(sampler.oid, base) > 0)
+	{
+		// Past the whole subtree
+		return false;
+	}
+	rowLength = samplerRowOID(sampler, column, index, row);
+	return true;
+}
+
+/**************************************************************************//**
+ * Function: berRead
+ *
+ * Description:
+ * Reads the tag and length of a BER field in the received packet and
+ * checks the field fits inside it.
+ *
+ * Parameters: 
+ * uint16_t & pos - Start of the field, moved to the start of its contents
+ * byte tag - The tag the field must have
+ * uint16_t & length - Set to the length of the contents
+ *
+ * Returns:
+ * true - Field read
+ * false - Wrong tag, bad length or runs past the end of the packet
+ *****************************************************************************/
+bool arduAgentClass::berRead(uint16_t & pos, byte tag, uint16_t & length){
+	if (pos + 2 > _packetSize || _packet[pos] != tag)
+	{
+		return false;
+	}
+	byte first = _packet[pos+1];
+	pos += 2;
+	if (first < 0x80)
+	{
+		length = first;
+	}
+	else if (first == 0x81 && pos + 1 <= _packetSize)
+	{
+		length = _packet[pos++];
+	}
+	else if (first == 0x82 && pos + 2 <= _packetSize)
+	{
+		length = (_packet[pos] << 8) | _packet[pos+1];
+		pos += 2;
+	}
+	else
+	{
+		return false;
+	}
+	return pos + length <= _packetSize;
+}
+
+/**************************************************************************//**
+ * Function: berHeaderLength
+ *
+ * Description:
+ * Returns the size of the tag and length of a BER field.
+ *
+ * Parameters: 
+ * uint16_t length - Length of the field's contents
+ *
+ * Returns:
+ * uint16_t - Bytes taken by the tag and length
+ *****************************************************************************/
+static uint16_t berHeaderLength(uint16_t length){
+	if (length < 0x80) return 2;
+	if (length < 0x100) return 3;
+	return 4;
+}
+
+/**************************************************************************//**
+ * Function: berHeader
+ *
+ * Description:
+ * Writes the tag and length of a BER field into a buffer.
+ *
+ * Parameters: 
+ * byte out[] - Where to write, up to 4 bytes
+ * byte tag - The field's tag
+ * uint16_t length - Length of the field's contents
+ *
+ * Returns:
+ * byte - Bytes written
+ *****************************************************************************/
+static byte berHeader(byte out[], byte tag, uint16_t length){
+	byte pos = 0;
+	out[pos++] = tag;
+	if (length >= 0x100)
+	{
+		out[pos++] = 0x82;
+		out[pos++] = length >> 8;
+	}
+	else if (length >= 0x80)
+	{
+		out[pos++] = 0x81;
+	}
+	out[pos++] = length & 0xff;
+	return pos;
+}
+
+/**************************************************************************//**
+ * Function: shortenInteger
+ *
+ * Description:
+ * Rewrites the INTEGER at pos in the received packet to take one byte,
+ * as the fixed offsets requestPdu reads the rest of the PDU from expect.
+ * Used for GETBULK, whose non-repeaters and max-repetitions sit where
+ * error-status and error-index do. Values are clamped to 0-127, which
+ * only means fewer repetitions than were asked for.
+ *
+ * Parameters: 
+ * uint16_t pos - Where the INTEGER's tag is
+ *
+ * Returns:
+ * true - INTEGER now takes one byte
+ * false - Not an INTEGER, or longer than 4 bytes
+ *****************************************************************************/
+bool arduAgentClass::shortenInteger(uint16_t pos){
+	byte length = _packet[pos+1];
+	int32_t value = 0;
+	if (_packet[pos] != 0x02 || length < 1 || length > 4 || pos + 2 + length > _packetSize)
+	{
+		return false;
+	}
+	if (length == 1)
+	{
+		return true;
+	}
+	for (int i = 0; i < length; i++)
+	{
+		value = (value << 8) | _packet[pos+2+i];
+	}
+	if (_packet[pos+2] & 0x80) value = 0;
+	else if (value > 127) value = 127;
+	_packet[pos+1] = 1;
+	_packet[pos+2] = value;
+	memmove(_packet + pos + 3, _packet + pos + 2 + length, _packetSize - (pos + 2 + length));
+	//Recalculate packet lengths
+	_packetSize -= length - 1;
+	_packet[1] -= length - 1;
+	_packet[_pduOffset+1] -= length - 1;
+	return true;
+}
+
+/**************************************************************************//**
+ * Function: requestBulk
+ *
+ * Description:
+ * Handles a GETBULK for the one varbind the agent reads. The OID is
+ * replaced with its successor as for GETNEXT. When that is a sampler's
+ * row and more than one repetition was asked for, the agent answers
+ * with as many of the sampler's rows as fit in SNMP_MAX_BULK_LEN.
+ * Otherwise the user's program answers it with a single varbind, which
+ * RFC 3416 allows when a response is cut down by local constraints.
+ * SNMPv3 answers are always a single varbind as the whole message has
+ * to be in _packet to be signed.
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - OID replaced, for the user's
+ *		program to answer
+ * SNMP_API_STAT_CODES SNMP_API_STAT_ANSWERED - Sampler rows sent
+ * SNMP_API_STAT_CODES SNMP_API_STAT_NO_SUCH_NAME - End of MIB (answered)
+ * SNMP_API_STAT_CODES SNMP_API_STAT_PACKET_INVALID - SNMPv1 has no GETBULK
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::requestBulk(void){
+	byte nonRepeaters = errorStatusCode[2];
+	byte maxRepetitions = snmpIndex[2];
+	uint32_t column;
+	uint32_t index;
+	// The response's error-status and error-index are 0
+	_packet[_pduOffset+6+requestIDlength] = 0;
+	_packet[_pduOffset+9+requestIDlength] = 0;
+	if (version[2] == 0)
+	{
+		return SNMP_API_STAT_PACKET_INVALID;
+	}
+	if (nonRepeaters == 0 && maxRepetitions == 0)
+	{
+		// Nothing asked for, answer with no varbinds
+		respondBulk(NULL, 0, 0, 0);
+		return SNMP_API_STAT_ANSWERED;
+	}
+	SNMP_API_STAT_CODES status = resolveNext();
+	if (status != SNMP_API_STAT_SUCCESS || nonRepeaters != 0 || maxRepetitions < 2)
+	{
+		return status;
+	}
+#if SNMP_USM
+	if (_usmRequest)
+	{
+		return status;
+	}
+#endif
+	const snmpSampler *sampler = findSamplerRow(column, index);
+	if (sampler == NULL)
+	{
+		return status;
+	}
+	respondBulk(sampler, column, index, maxRepetitions);
+	return SNMP_API_STAT_ANSWERED;
+}
+
+/**************************************************************************//**
+ * Function: respondBulk
+ *
+ * Description:
+ * Sends a GETBULK response of consecutive rows of a sampler, starting
+ * with the one given. The response is written straight to the UDP
+ * socket, as it is too big for _packet. The version, community and
+ * request ID are copied from the received packet.
+ *
+ * Parameters: 
+ * const snmpSampler *sampler - The sampler, NULL for no rows
+ * uint32_t column - First row's column
+ * uint32_t index - First row's index
+ * byte repetitions - Most rows to send
+ *
+ * Returns:
+ * None
+ *****************************************************************************/
+void arduAgentClass::respondBulk(const snmpSampler *sampler, uint32_t column, uint32_t index, byte repetitions){
+	static const byte noError[] = {0x02, 1, 0, 0x02, 1, 0};
+	byte varbind[4 + SNMP_MAX_SAMPLER_ROW + 6];
+	byte header[4];
+	uint16_t prefix = _pduOffset - 2;	// Version and community
+	uint16_t requestIDField = 2 + requestIDlength;
+	// Room for the rows, taking the longest headers around them
+	uint16_t room = SNMP_MAX_BULK_LEN - (4 + prefix + 4 + requestIDField + sizeof(noError) + 4);
+	uint16_t list = 0;
+	byte rows = 0;
+	uint32_t c = column;
+	uint32_t i = index;
+	while (sampler != NULL && rows < repetitions)
+	{
+		uint16_t length = 4 + samplerRowOID(*sampler, c, i, varbind) + 6;
+		if (list + length > room)
+		{
+			break;
+		}
+		list += length;
+		rows++;
+		if (!nextSamplerRow(*sampler, c, i))
+		{
+			break;
+		}
+	}
+	uint16_t pdu = requestIDField + sizeof(noError) + berHeaderLength(list) + list;
+	uint16_t message = prefix + berHeaderLength(pdu) + pdu;
+	
+	if(!Udp.beginPacket(IPAddress(_dstIp[0], _dstIp[1], _dstIp[2], _dstIp[3]), _dstPort))
+	{
+		return;
+	}
+	Udp.write(header, berHeader(header, 0x30, message));
+	Udp.write(_packet + 2, prefix);
+	Udp.write(header, berHeader(header, 0xa2, pdu));	//Response
+	Udp.write(_packet + _pduOffset + 2, requestIDField);
+	Udp.write(noError, sizeof(noError));
+	Udp.write(header, berHeader(header, 0x30, list));
+	for (int row = 0; row < rows; row++)
+	{
+		int32_t value = 0;
+		byte rowLength = samplerRowOID(*sampler, column, index, varbind + 4);
+		samplerValue(*sampler, column, index, value);
+		byte pos = 4 + rowLength;
+		varbind[0] = 0x30;
+		varbind[1] = 2 + rowLength + 6;
+		varbind[2] = 0x06;
+		varbind[3] = rowLength;
+		varbind[pos++] = 0x02;	//Integer
+		varbind[pos++] = 4;
+		for (int shift = 24; shift >= 0; shift -= 8)
+		{
+			varbind[pos++] = (byte) (value >> shift);
+		}
+		Udp.write(varbind, pos);
+		nextSamplerRow(*sampler, column, index);
+	}
+	Udp.endPacket();
+}
+
+#if SNMP_USM
+/**************************************************************************//**
+ * Function: berUnsignedLength
+ *
+ * Description:
+ * Returns how many bytes an unsigned value takes as a BER integer.
+ *
+ * Parameters: 
+ * uint32_t value - The value
+ *
+ * Returns:
+ * byte - Bytes of contents, 1 to 5
+ *****************************************************************************/
+static byte berUnsignedLength(uint32_t value){
+	byte length = 1;
+	while (length < 4 && (value >> (8*length - 1)) != 0)
+	{
+		length++;
+	}
+	// An extra byte when the top bit is set, so it doesn't read as negative
+	if (length == 4 && (value & 0x80000000))
+	{
+		length = 5;
+	}
+	return length;
+}
+
+/**************************************************************************//**
+ * Function: berWriteHeader
+ *
+ * Description:
+ * Writes the tag and length of a BER field into _packet.
+ *
+ * Parameters: 
+ * uint16_t pos - Where to write
+ * byte tag - The field's tag
+ * uint16_t length - Length of the field's contents
+ *
+ * Returns:
+ * uint16_t - Where the contents start
+ *****************************************************************************/
+uint16_t arduAgentClass::berWriteHeader(uint16_t pos, byte tag, uint16_t length){
+	return pos + berHeader(_packet + pos, tag, length);
+}
+
+/**************************************************************************//**
+ * Function: berWriteUnsigned
+ *
+ * Description:
+ * Writes an unsigned value as a BER integer (or Counter32 etc.) into
+ * _packet.
+ *
+ * Parameters: 
+ * uint16_t pos - Where to write
+ * byte tag - The field's tag
+ * uint32_t value - The value
+ *
+ * Returns:
+ * uint16_t - Where the next field starts
+ *****************************************************************************/
+uint16_t arduAgentClass::berWriteUnsigned(uint16_t pos, byte tag, uint32_t value){
+	byte length = berUnsignedLength(value);
+	pos = berWriteHeader(pos, tag, length);
+	for (int i = length - 1; i >= 0; i--)
+	{
+		_packet[pos++] = (i < 4) ? (byte) (value >> (8*i)) : 0;
+	}
+	return pos;
+}
+
+/**************************************************************************//**
+ * Function: usmTick
+ *
+ * Description:
+ * Keeps the engine time (whole seconds since beginUsm) counting across
+ * millis() wrapping. Called from listen().
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * None
+ *****************************************************************************/
+void arduAgentClass::usmTick(void){
+	uint32_t seconds = (millis() - _usmLastMillis) / 1000;
+	_usmTime += seconds;
+	_usmLastMillis += seconds * 1000;
+}
+
+/**************************************************************************//**
+ * Function: requestUsm
+ *
+ * Description:
+ * Parses the SNMPv3 header of the received packet and runs the USM checks
+ * of RFC 3414 section 3.2: engine ID, user, security level, HMAC-SHA-96
+ * digest and time window. The digest is computed from the HMAC states
+ * saved by beginUsm, so only the message itself is hashed. When a check
+ * fails and the manager asked for reports, the matching usmStats report
+ * is sent (this is also how managers discover our engine ID and time).
+ * Only authNoPriv and the default context are supported.
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_SUCCESS - Authenticated, _pduOffset set
+ * SNMP_API_STAT_CODES SNMP_API_STAT_NOT_AUTHENTICATED - Failed or malformed
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::requestUsm(void){
+	uint16_t pos = 0;
+	uint16_t length;
+	uint16_t messageLength;
+	uint16_t engineIDPos, engineIDLength;
+	uint16_t userPos, userLength;
+	uint16_t authPos, authLength;
+	uint32_t boots = 0;
+	uint32_t time = 0;
+	bool havePdu = false;
+	byte received[SNMP_USM_AUTH_LEN];
+	byte mac[SNMP_SHA1_DIGEST_LEN];
+	byte difference = 0;
+	
+	version[2] = 3;
+	lengthCommunityName = 0;
+	_usmFlags = 0;
+	if (!_usmEnabled || !berRead(pos, 0x30, messageLength))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	messageLength += pos;
+	pos += 3;	// Version, already checked
+	// msgGlobalData
+	if (!berRead(pos, 0x30, length) || !berRead(pos, 0x02, length) ||
+		length == 0 || length > sizeof(_usmMsgId))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	memcpy(_usmMsgId, _packet + pos, length);
+	_usmMsgIdLength = length;
+	pos += length;
+	if (!berRead(pos, 0x02, length))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	pos += length;	// msgMaxSize, our responses are always small
+	if (!berRead(pos, 0x04, length) || length != 1)
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	_usmFlags = _packet[pos++];
+	if (!berRead(pos, 0x02, length) || length != 1 || _packet[pos] != 3)
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	pos += length;
+	// msgSecurityParameters
+	if (!berRead(pos, 0x04, length) || !berRead(pos, 0x30, length) ||
+		!berRead(pos, 0x04, engineIDLength))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	engineIDPos = pos;
+	pos += engineIDLength;
+	if (!berRead(pos, 0x02, length) || length > 5)
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	while (length--) boots = (boots << 8) | _packet[pos++];
+	if (!berRead(pos, 0x02, length) || length > 5)
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	while (length--) time = (time << 8) | _packet[pos++];
+	if (!berRead(pos, 0x04, userLength))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	userPos = pos;
+	pos += userLength;
+	if (!berRead(pos, 0x04, authLength))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	authPos = pos;
+	pos += authLength;
+	if (!berRead(pos, 0x04, length))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	pos += length;
+	// Plain scopedPDU: contextEngineID, empty contextName, then the PDU
+	_pduOffset = pos;
+	if (!(_usmFlags & 0x02) && berRead(pos, 0x30, length) && berRead(pos, 0x04, length))
+	{
+		pos += length;
+		if (berRead(pos, 0x04, length) && length == 0 &&
+			pos + 2 <= _packetSize && _packet[pos+1] < 0x80)
+		{
+			_pduOffset = pos;
+			havePdu = true;
+		}
+	}
+	
+	if (engineIDLength != _usmEngineIDLength ||
+		memcmp(_packet + engineIDPos, _usmEngineID, engineIDLength) != 0)
+	{
+		return usmReport(SNMP_USM_UNKNOWN_ENGINE_IDS, false);
+	}
+	if (userLength != _usmUserLength ||
+		memcmp(_packet + userPos, _usmUserName, userLength) != 0)
+	{
+		return usmReport(SNMP_USM_UNKNOWN_USER_NAMES, false);
+	}
+	if ((_usmFlags & 0x03) != 0x01)
+	{
+		// Only authNoPriv
+		return usmReport(SNMP_USM_UNSUPPORTED_SEC_LEVELS, false);
+	}
+	if (authLength != SNMP_USM_AUTH_LEN)
+	{
+		return usmReport(SNMP_USM_WRONG_DIGESTS, false);
+	}
+	// The digest is computed with its own field zeroed
+	memcpy(received, _packet + authPos, SNMP_USM_AUTH_LEN);
+	memset(_packet + authPos, 0, SNMP_USM_AUTH_LEN);
+	hmacSha1(_usmKey, _packet, messageLength, mac);
+	for (int i = 0; i < SNMP_USM_AUTH_LEN; i++)
+	{
+		difference |= mac[i] ^ received[i];
+	}
+	if (difference != 0)
+	{
+		return usmReport(SNMP_USM_WRONG_DIGESTS, false);
+	}
+	usmTick();
+	if (boots != _usmBoots || time > _usmTime + SNMP_USM_TIME_WINDOW ||
+		time + SNMP_USM_TIME_WINDOW < _usmTime)
+	{
+		return usmReport(SNMP_USM_NOT_IN_TIME_WINDOWS, true);
+	}
+	if (!havePdu)
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	_usmRequest = true;
+	_usmResponseFlags = 0x01;	// Authenticated, not reportable
+	return SNMP_API_STAT_SUCCESS;
+}
+
+/**************************************************************************//**
+ * Function: usmReport
+ *
+ * Description:
+ * Counts a USM failure and, if the request was reportable, answers it with
+ * a Report PDU holding the matching usmStats counter. The report carries
+ * our engine ID, boots and time so the manager can synchronise.
+ *
+ * Parameters: 
+ * SNMP_USM_STATS stat - Which check failed
+ * bool authenticated - Send the report authenticated (not in time window)
+ *
+ * Returns:
+ * SNMP_API_STAT_CODES SNMP_API_STAT_NOT_AUTHENTICATED - Always
+ *****************************************************************************/
+SNMP_API_STAT_CODES arduAgentClass::usmReport(SNMP_USM_STATS stat, bool authenticated){
+	static const byte usmStatsOid[] = {0x2b, 6, 1, 6, 3, 15, 1, 1};
+	uint16_t pos = _pduOffset;
+	uint16_t length;
+	uint32_t counter = ++_usmStats[stat - 1];
+	
+	if (!(_usmFlags & 0x04))
+	{
+		return SNMP_API_STAT_NOT_AUTHENTICATED;
+	}
+	// Use the request's request-id if it can be read
+	requestID[0] = 0x02;
+	requestID[1] = 1;
+	requestID[2] = 0;
+	if (pos < _packetSize && berRead(pos, _packet[pos], length) && berRead(pos, 0x02, length) &&
+		length >= 1 && length <= sizeof(requestID) - 2)
+	{
+		requestID[1] = length;
+		memcpy(requestID + 2, _packet + pos, length);
+	}
+	requestIDlength = requestID[1];
+	
+	// Build the PDU at the end of the buffer, finalizeUsm moves it
+	byte counterLength = berUnsignedLength(counter);
+	byte varbindLength = 2 + sizeof(usmStatsOid) + 2 + 2 + counterLength;
+	byte pduLength = 2 + requestIDlength + 3 + 3 + 2 + 2 + varbindLength;
+	pos = SNMP_MAX_PACKET_LEN - (2 + pduLength);
+	_pduOffset = pos;
+	pos = berWriteHeader(pos, 0xa8, pduLength);	// Report
+	pos = berWriteHeader(pos, 0x02, requestIDlength);
+	memcpy(_packet + pos, requestID + 2, requestIDlength);
+	pos += requestIDlength;
+	pos = berWriteUnsigned(pos, 0x02, 0);	// error-status
+	pos = berWriteUnsigned(pos, 0x02, 0);	// error-index
+	pos = berWriteHeader(pos, 0x30, 2 + varbindLength);
+	pos = berWriteHeader(pos, 0x30, varbindLength);
+	pos = berWriteHeader(pos, 0x06, sizeof(usmStatsOid) + 2);
+	memcpy(_packet + pos, usmStatsOid, sizeof(usmStatsOid));
+	pos += sizeof(usmStatsOid);
+	_packet[pos++] = stat;
+	_packet[pos++] = 0;
+	berWriteUnsigned(pos, 0x41, counter);	// Counter32
+	
+	_usmRequest = true;
+	_usmResponseFlags = authenticated ? 0x01 : 0x00;
+	send_response();
+	return SNMP_API_STAT_NOT_AUTHENTICATED;
+}
+
+/**************************************************************************//**
+ * Function: finalizeUsm
+ *
+ * Description:
+ * Puts a fresh SNMPv3 header in front of the PDU that was built at
+ * _pduOffset, with our engine ID, boots and time, and fills in the
+ * HMAC-SHA-96 digest when the response is authenticated.
+ *
+ * Parameters: 
+ * None
+ *
+ * Returns:
+ * uint16_t - Length of the whole message, 0 if it doesn't fit
+ *****************************************************************************/
+uint16_t arduAgentClass::finalizeUsm(void){
+	bool authenticated = _usmResponseFlags & 0x01;
+	uint16_t pduLength = 2 + _packet[_pduOffset+1];
+	byte userLength = authenticated ? _usmUserLength : 0;
+	byte authLength = authenticated ? SNMP_USM_AUTH_LEN : 0;
+	uint16_t security = 2 + _usmEngineIDLength + 2 + berUnsignedLength(_usmBoots) +
+		2 + berUnsignedLength(_usmTime) + 2 + userLength + 2 + authLength + 2;
+	uint16_t securityOctets = berHeaderLength(security) + security;
+	uint16_t global = 2 + _usmMsgIdLength + 2 + berUnsignedLength(SNMP_USM_MAX_SIZE) + 3 + 3;
+	uint16_t scoped = 2 + _usmEngineIDLength + 2 + pduLength;
+	uint16_t message = 3 + 2 + global + berHeaderLength(securityOctets) + securityOctets +
+		berHeaderLength(scoped) + scoped;
+	uint16_t total = berHeaderLength(message) + message;
+	uint16_t pos = 0;
+	uint16_t authPos;
+	byte mac[SNMP_SHA1_DIGEST_LEN];
+	
+	if (total > SNMP_MAX_PACKET_LEN)
+	{
+		return 0;
+	}
+	// PDU goes straight after the new header
+	memmove(_packet + total - pduLength, _packet + _pduOffset, pduLength);
+	_pduOffset = total - pduLength;
+	
+	pos = berWriteHeader(pos, 0x30, message);
+	pos = berWriteUnsigned(pos, 0x02, 3);
+	pos = berWriteHeader(pos, 0x30, global);
+	pos = berWriteHeader(pos, 0x02, _usmMsgIdLength);
+	memcpy(_packet + pos, _usmMsgId, _usmMsgIdLength);
+	pos += _usmMsgIdLength;
+	pos = berWriteUnsigned(pos, 0x02, SNMP_USM_MAX_SIZE);
+	pos = berWriteHeader(pos, 0x04, 1);
+	_packet[pos++] = _usmResponseFlags;
+	pos = berWriteUnsigned(pos, 0x02, 3);	// USM
+	pos = berWriteHeader(pos, 0x04, securityOctets);
+	pos = berWriteHeader(pos, 0x30, security);
+	pos = berWriteHeader(pos, 0x04, _usmEngineIDLength);
+	memcpy(_packet + pos, _usmEngineID, _usmEngineIDLength);
+	pos += _usmEngineIDLength;
+	pos = berWriteUnsigned(pos, 0x02, _usmBoots);
+	pos = berWriteUnsigned(pos, 0x02, _usmTime);
+	pos = berWriteHeader(pos, 0x04, userLength);
+	memcpy(_packet + pos, _usmUserName, userLength);
+	pos += userLength;
+	pos = berWriteHeader(pos, 0x04, authLength);
+	authPos = pos;
+	memset(_packet + pos, 0, authLength);
+	pos += authLength;
+	pos = berWriteHeader(pos, 0x04, 0);	// No privacy
+	pos = berWriteHeader(pos, 0x30, scoped);
+	pos = berWriteHeader(pos, 0x04, _usmEngineIDLength);
+	memcpy(_packet + pos, _usmEngineID, _usmEngineIDLength);
+	pos += _usmEngineIDLength;
+	berWriteHeader(pos, 0x04, 0);	// Default context
+	
+	if (authenticated)
+	{
+		hmacSha1(_usmKey, _packet, total, mac);
+		memcpy(_packet + authPos, mac, SNMP_USM_AUTH_LEN);
+	}
+	return total;
+}
+#endif
 	
 // Create one global object
 arduAgentClass arduAgent;
\ No newline at end of file
@@ -26,15 +26,48 @@
 #define SNMP_MAX_OID_LEN	64
 #define SNMP_MAX_NAME_LEN	20
 #define SNMP_MAX_VALUE_LEN      64
-#define SNMP_MAX_PACKET_LEN     SNMP_MAX_VALUE_LEN + SNMP_MAX_OID_LEN + 25  //???
+#define SNMP_USM		0	//SNMPv3 USM authentication, 1 builds it in
+#if SNMP_USM
+#define SNMP_USM_OVERHEAD	160	//Room for the SNMPv3 header around the PDU
+#else
+#define SNMP_USM_OVERHEAD	0
+#endif
+#define SNMP_MAX_PACKET_LEN     (SNMP_MAX_VALUE_LEN + SNMP_MAX_OID_LEN + 25 + SNMP_USM_OVERHEAD)  //???
 #define SNMP_MAX_SET_LEN 20 //Arbitrary
+#define SNMP_MAX_BATCH		4	//Datagrams handled per call to listen()
+#define SNMP_WALK_CURSORS	4	//Managers whose GETNEXT position is remembered
+#define SNMP_MAX_SAMPLERS	2	//Samplers that can be registered (storage is the user's)
+#define SNMP_HISTORY_LEN	60	//Samples kept per source
+#define SNMP_MAX_SAMPLER_OID	16	//Encoded bytes in a sampler's base OID
+#define SNMP_MAX_ARC_LEN	5	//Encoded bytes in one 32 bit sub-identifier
+#define SNMP_MAX_SAMPLER_ROW	(SNMP_MAX_SAMPLER_OID + 2 * SNMP_MAX_ARC_LEN)
+#define SNMP_MAX_BULK_LEN	484	//Bytes in a GETBULK answer of sampler rows
+#define SNMP_USM_MAX_ENGINE_ID	32
+#define SNMP_USM_MAX_USER	32
+#define SNMP_USM_TIME_WINDOW	150	//Seconds a v3 request may be early or late
+#define SNMP_USM_MAX_SIZE	484	//msgMaxSize we advertise (RFC minimum)
 
 #include "Arduino.h"
 #include "Udp.h"
+#if SNMP_USM
+#include "snmpUsm.h"
+#endif
+
+// Stops the compiler (and on multi-core parts, the CPU) reordering memory
+// accesses across this point. Interrupts are the only concurrency on AVR.
+#if defined(__AVR__)
+#define SNMP_MEMORY_BARRIER()	__asm__ __volatile__("" ::: "memory")
+typedef uint8_t snmpSequence_t;		// Single byte so reads are atomic
+#else
+#define SNMP_MEMORY_BARRIER()	__sync_synchronize()
+typedef uint32_t snmpSequence_t;
+#endif
 
 extern "C" {
 	// callback function
 	typedef void (*onPduReceiveCallback)(void);
+	// sampler source function
+	typedef int32_t (*snmpSampleSource)(void);
 }
 
 typedef union uint64_u {
@@ -66,6 +99,9 @@ typedef enum SNMP_API_STAT_CODES {
 	SNMP_API_STAT_PACKET_INVALID = 5,
 	SNMP_API_STAT_PACKET_TOO_BIG = 6,
 	SNMP_API_STAT_NO_SUCH_NAME = 7,
+	SNMP_API_STAT_MIB_UNORDERED = 8,
+	SNMP_API_STAT_NOT_AUTHENTICATED = 9,
+	SNMP_API_STAT_ANSWERED = 10,
 };
 
 typedef enum SNMP_ERR_CODES {
@@ -93,7 +129,117 @@ typedef enum SNMP_ERR_CODES {
 
 typedef enum SNMP_REQUEST_TYPES {
 	SNMP_GET=0xa0,
-	SNMP_SET=0xa3
+	SNMP_GETNEXT=0xa1,
+	SNMP_SET=0xa3,
+	SNMP_GETBULK=0xa5
+};
+
+// usmStats counters (1.3.6.1.6.3.15.1.1.x.0), reported to v3 managers
+enum SNMP_USM_STATS {
+	SNMP_USM_UNSUPPORTED_SEC_LEVELS	= 1,
+	SNMP_USM_NOT_IN_TIME_WINDOWS	= 2,
+	SNMP_USM_UNKNOWN_USER_NAMES		= 3,
+	SNMP_USM_UNKNOWN_ENGINE_IDS		= 4,
+	SNMP_USM_WRONG_DIGESTS			= 5,
+	SNMP_USM_DECRYPTION_ERRORS		= 6
+};
+
+/*
+  OIDs are held the way they're sent: BER encoded, with the first two
+  arcs sharing a byte (40*x+y, so .1.3 is 0x2b) and arcs above 127 split
+  into 7 bit groups, high group first, with the top bit set on all but
+  the last. These macros spell out such an arc in an OID array, e.g.
+  .1.3.6.1.4.1.36582 is {0x2b,6,1,4,1,SNMP_ARC3(36582)}.
+*/
+#define SNMP_ARC2(arc)	(byte) (0x80 | (((arc) >> 7) & 0x7f)), (byte) ((arc) & 0x7f)
+#define SNMP_ARC3(arc)	(byte) (0x80 | (((arc) >> 14) & 0x7f)), SNMP_ARC2(arc)
+
+// One OID the agent answers for, used to find the successor for GETNEXT
+typedef struct {
+	const byte *oid;	// Encoded OID
+	byte length;	// Number of bytes in oid
+} snmpMibEntry;
+
+// Rows under a sampler's base OID. Columns 1-5 are scalars (.0),
+// history is indexed by sample number, counting from 1 for the first
+// sample taken, so a row keeps its index until it drops out of the
+// buffer (like etherHistorySampleIndex).
+enum SNMP_SAMPLER_COLUMNS {
+	SNMP_SAMPLE_LAST	= 1,
+	SNMP_SAMPLE_MIN		= 2,
+	SNMP_SAMPLE_MAX		= 3,
+	SNMP_SAMPLE_MEAN	= 4,
+	SNMP_SAMPLE_COUNT	= 5,
+	SNMP_SAMPLE_HISTORY	= 6
+};
+
+// A source sampled at a fixed interval into a ring buffer. These are
+// large, so the user's program declares one for each addSampler() call.
+typedef struct {
+	const byte *oid;	// Encoded base OID the rows are exposed under
+	byte oidLength;
+	snmpSampleSource source;
+	uint32_t interval;	// Milliseconds between samples
+	uint32_t lastSample;
+	int32_t history[SNMP_HISTORY_LEN];
+	byte head;		// Slot holding the newest sample
+	byte count;		// Samples held, up to SNMP_HISTORY_LEN
+	uint32_t taken;		// Samples taken, the newest's history index
+	int64_t sum;		// Running total of the samples held
+	int32_t min;
+	int32_t max;
+	int32_t mean;
+} snmpSampler;
+
+// Where a manager's walk got to, so its next GETNEXT skips the search
+typedef struct {
+	uint8_t ip[4];
+	uint16_t port;
+	byte index;		// Entry in the MIB last returned to this manager
+	bool valid;
+} snmpWalkCursor;
+
+/*
+  A variable that an interrupt (or another thread) can update while the
+  agent reads it to build a response. The writer makes the sequence
+  number odd while it copies the value in and even again after, and the
+  reader copies the value out again if the number was odd or changed.
+  Neither side ever waits on the other or disables interrupts, and
+  values of any size are read whole.
+  Each cell must have only one writer, and it must not be read from an
+  interrupt that can interrupt its writer.
+*/
+template <typename T>
+class snmpValueCell {
+public:
+	snmpValueCell() : _sequence(0), _value() {}
+	snmpValueCell(const T & value) : _sequence(0), _value(value) {}
+	
+	void write(const T & value){
+		_sequence++;
+		SNMP_MEMORY_BARRIER();
+		_value = value;
+		SNMP_MEMORY_BARRIER();
+		_sequence++;
+	}
+	
+	T read(void) const {
+		T copy;
+		snmpSequence_t before;
+		snmpSequence_t after;
+		do {
+			before = _sequence;
+			SNMP_MEMORY_BARRIER();
+			copy = _value;
+			SNMP_MEMORY_BARRIER();
+			after = _sequence;
+		} while ((before & 1) || before != after);
+		return copy;
+	}
+
+private:
+	volatile snmpSequence_t _sequence;
+	T _value;
 };
 
 class arduAgentClass {
@@ -101,16 +247,42 @@ public:
 	// Agent functions
 	SNMP_API_STAT_CODES begin();
 	SNMP_API_STAT_CODES begin(char *getCommName, char *setCommName, uint16_t port);
+#if SNMP_USM
+	SNMP_API_STAT_CODES beginUsm(const char *userName, const char *authPassword, const byte engineID[], byte engineIDLength, uint32_t engineBoots);
+	SNMP_API_STAT_CODES beginUsm(const char *userName, const byte authKey[], const byte engineID[], byte engineIDLength, uint32_t engineBoots);
+#endif
 	void listen(void);
 	SNMP_API_STAT_CODES requestPdu();
 	SNMP_API_STAT_CODES responsePdu();
 	void onPduReceive(onPduReceiveCallback pduReceived);
 	void createResponsePDU(int respondValue);
 	void createResponsePDU(char respondValue[]);
+	// Integer cells up to 32 bits are answered as an INTEGER, or a Gauge32
+	// for 32 bit unsigned ones. Other types won't compile.
+	template <typename T> void createResponsePDU(const snmpValueCell<T> & respondValue){
+		static_assert(sizeof(T) <= 4, "value cells are answered as 32 bit numbers");
+		respondCell(respondValue.read());
+	}
 	SNMP_API_STAT_CODES set(int & reqValue);
+	SNMP_API_STAT_CODES set(snmpValueCell<int> & reqValue);
+	SNMP_API_STAT_CODES setMib(const snmpMibEntry mib[], byte count);
+	SNMP_API_STAT_CODES addSampler(snmpSampler & sampler, const byte oid[], byte length, snmpSampleSource source, uint32_t interval);
+	bool respondSampler(void);
+	uint32_t msUntilNextSample(void);
 	
 	// Helper functions
-	bool checkOID( const int inputoid[]);
+	template <size_t N> bool checkOID(const byte (&inputoid)[N]){
+		return checkOID(inputoid, N);
+	}
+	bool checkOID(const byte inputoid[], byte length);
+	// Integer arc arrays must match all N arcs. The pointer form is only
+	// for callers without the array's size and is deprecated: it matches
+	// when the received OID is a prefix of inputoid, and it can't tell
+	// where inputoid ends. The volatile makes arrays pick the sized form.
+	template <size_t N> bool checkOID(const int (&inputoid)[N]){
+		return matchArcs(inputoid, N);
+	}
+	bool checkOID(const volatile int inputoid[]);
 	void getOID(byte input[]);
 	int getOIDlength(void);
 	SNMP_API_STAT_CODES send_response(void);
@@ -120,6 +292,9 @@ public:
 	SNMP_ERR_CODES authenticateSetCommunity(void);
 	SNMP_ERR_CODES generalAuthenticator(void);
 	SNMP_REQUEST_TYPES requestType(void);
+	int compareOID(const byte oid[], byte length);
+	byte encodeOID(const uint32_t arcs[], byte count, byte encoded[]);
+	byte decodeOID(const byte encoded[], byte length, uint32_t arcs[], byte maxArcs);
 	
 
 private:
@@ -127,11 +302,70 @@ private:
 	uint16_t _packetSize;
 	uint16_t _packetPos;
 	uint8_t _dstIp[4];
+	uint16_t _dstPort;
 	char *_getCommName;
 	size_t _getSize;
 	char *_setCommName;
 	size_t _setSize;
 	onPduReceiveCallback _callback;
+	const snmpMibEntry *_mib = NULL;
+	byte _mibCount = 0;
+	snmpWalkCursor _cursors[SNMP_WALK_CURSORS];
+	byte _nextCursor = 0;
+	snmpSampler *_samplers[SNMP_MAX_SAMPLERS];
+	byte _samplerCount = 0;
+	
+	SNMP_API_STAT_CODES resolveNext(void);
+	void rewriteOID(const byte oid[], byte length);
+	const byte *receivedOID(void);
+	bool samplerNext(const snmpSampler & sampler, byte row[], byte & rowLength);
+	const snmpSampler *findSamplerRow(uint32_t & column, uint32_t & index);
+	SNMP_API_STAT_CODES requestBulk(void);
+	void respondBulk(const snmpSampler *sampler, uint32_t column, uint32_t index, byte repetitions);
+	bool shortenInteger(uint16_t pos);
+	void runSamplers(void);
+	bool matchArcs(const volatile int arcs[], size_t count);
+	void respondInteger(int32_t respondValue);
+	void respondGauge(uint32_t respondValue);
+	void respondNumber(byte tag, uint32_t respondValue, byte length);
+	SNMP_API_STAT_CODES receivedInteger(int & value);
+	void respondCell(signed char value) { respondInteger(value); }
+	void respondCell(unsigned char value) { respondInteger(value); }
+	void respondCell(short value) { respondInteger(value); }
+	void respondCell(unsigned short value) { respondInteger(value); }
+	void respondCell(int value) { respondInteger(value); }
+	void respondCell(unsigned int value) {
+		if (sizeof(value) < 4) respondInteger(value);
+		else respondGauge(value);
+	}
+	void respondCell(long value) { respondInteger(value); }
+	void respondCell(unsigned long value) { respondGauge(value); }
+	uint16_t _pduOffset;	// Where the PDU starts in _packet
+	bool berRead(uint16_t & pos, byte tag, uint16_t & length);
+#if SNMP_USM
+	uint16_t berWriteHeader(uint16_t pos, byte tag, uint16_t length);
+	uint16_t berWriteUnsigned(uint16_t pos, byte tag, uint32_t value);
+	bool _usmEnabled = false;
+	bool _usmRequest = false;	// Response needs a v3 header
+	const char *_usmUserName;
+	byte _usmUserLength;
+	byte _usmEngineID[SNMP_USM_MAX_ENGINE_ID];
+	byte _usmEngineIDLength;
+	snmpHmacKey _usmKey;
+	uint32_t _usmBoots;
+	uint32_t _usmTime;			// Seconds since beginUsm
+	uint32_t _usmLastMillis;
+	byte _usmMsgId[5];
+	byte _usmMsgIdLength;
+	byte _usmFlags;				// msgFlags of the request
+	byte _usmResponseFlags;
+	uint32_t _usmStats[SNMP_USM_DECRYPTION_ERRORS];
+	
+	SNMP_API_STAT_CODES requestUsm(void);
+	SNMP_API_STAT_CODES usmReport(SNMP_USM_STATS stat, bool authenticated);
+	uint16_t finalizeUsm(void);
+	void usmTick(void);
+#endif
 	
 	//New PDU structure
 	byte ans1Header;
@@ -147,9 +381,7 @@ private:
 	byte varbindList[2];
 	byte varbind[2];
 	byte objectID;
-	byte oidLength;
-	short int oid[64] = {0x00};
-	int setValueInt =0;
+	byte oidLength;		// Encoded OID is left in _packet, see receivedOID()
 	char setValueChar[SNMP_MAX_SET_LEN] ={0}; //Size arbitrary
 	unsigned short int setLength = 0;
 	byte nulValue[2]={0x05,0x00};
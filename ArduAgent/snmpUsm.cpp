@@ -0,0 +1,304 @@
+/*
+  snmpUsm.cpp - SHA-1, HMAC and key localization for SNMPv3 USM.
+  Copyright (C) 2016 Adrian Del Grosso
+  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "snmpUsm.h"
+
+#define SHA1_ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/**************************************************************************//**
+ * Function: sha1Block
+ *
+ * Description:
+ * Runs the SHA-1 compression function over the 64 bytes in ctx.buffer.
+ * The message schedule is kept as a rolling 16 word window to save RAM.
+ *
+ * Parameters:
+ * snmpSha1Context & ctx - The hash being computed
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+static void sha1Block(snmpSha1Context & ctx){
+	uint32_t w[16];
+	uint32_t a = ctx.state[0];
+	uint32_t b = ctx.state[1];
+	uint32_t c = ctx.state[2];
+	uint32_t d = ctx.state[3];
+	uint32_t e = ctx.state[4];
+	for (int i = 0; i < 16; i++)
+	{
+		w[i] = ((uint32_t) ctx.buffer[i*4] << 24) | ((uint32_t) ctx.buffer[i*4+1] << 16) |
+			((uint32_t) ctx.buffer[i*4+2] << 8) | (uint32_t) ctx.buffer[i*4+3];
+	}
+	for (int i = 0; i < 80; i++)
+	{
+		uint32_t f;
+		uint32_t k;
+		if (i >= 16)
+		{
+			uint32_t x = w[(i+13) & 15] ^ w[(i+8) & 15] ^ w[(i+2) & 15] ^ w[i & 15];
+			w[i & 15] = SHA1_ROL(x, 1);
+		}
+		if (i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if (i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		uint32_t temp = SHA1_ROL(a, 5) + f + e + k + w[i & 15];
+		e = d;
+		d = c;
+		c = SHA1_ROL(b, 30);
+		b = a;
+		a = temp;
+	}
+	ctx.state[0] += a;
+	ctx.state[1] += b;
+	ctx.state[2] += c;
+	ctx.state[3] += d;
+	ctx.state[4] += e;
+}
+
+/**************************************************************************//**
+ * Function: sha1Init
+ *
+ * Description:
+ * Starts a new SHA-1 hash.
+ *
+ * Parameters:
+ * snmpSha1Context & ctx - The hash to start
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void sha1Init(snmpSha1Context & ctx){
+	ctx.state[0] = 0x67452301;
+	ctx.state[1] = 0xEFCDAB89;
+	ctx.state[2] = 0x98BADCFE;
+	ctx.state[3] = 0x10325476;
+	ctx.state[4] = 0xC3D2E1F0;
+	ctx.count = 0;
+}
+
+/**************************************************************************//**
+ * Function: sha1Update
+ *
+ * Description:
+ * Adds data to a SHA-1 hash.
+ *
+ * Parameters:
+ * snmpSha1Context & ctx - The hash being computed
+ * const byte *data - Data to hash
+ * uint32_t length - Number of bytes in data
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void sha1Update(snmpSha1Context & ctx, const byte *data, uint32_t length){
+	while (length > 0)
+	{
+		byte used = ctx.count % SNMP_SHA1_BLOCK_LEN;
+		uint32_t take = SNMP_SHA1_BLOCK_LEN - used;
+		if (take > length) take = length;
+		memcpy(ctx.buffer + used, data, take);
+		ctx.count += take;
+		data += take;
+		length -= take;
+		if (ctx.count % SNMP_SHA1_BLOCK_LEN == 0)
+		{
+			sha1Block(ctx);
+		}
+	}
+}
+
+/**************************************************************************//**
+ * Function: sha1Final
+ *
+ * Description:
+ * Pads the message and writes out the digest. ctx can't be used again
+ * until sha1Init is called.
+ *
+ * Parameters:
+ * snmpSha1Context & ctx - The hash being computed
+ * byte digest[] - Receives the 20 byte digest
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void sha1Final(snmpSha1Context & ctx, byte digest[SNMP_SHA1_DIGEST_LEN]){
+	uint32_t bits = ctx.count << 3;
+	byte used = ctx.count % SNMP_SHA1_BLOCK_LEN;
+	ctx.buffer[used++] = 0x80;
+	if (used > SNMP_SHA1_BLOCK_LEN - 8)
+	{
+		memset(ctx.buffer + used, 0, SNMP_SHA1_BLOCK_LEN - used);
+		sha1Block(ctx);
+		used = 0;
+	}
+	memset(ctx.buffer + used, 0, SNMP_SHA1_BLOCK_LEN - 4 - used);
+	// Messages here are far below 2^32 bits, the top word is always 0
+	ctx.buffer[60] = (byte) (bits >> 24);
+	ctx.buffer[61] = (byte) (bits >> 16);
+	ctx.buffer[62] = (byte) (bits >> 8);
+	ctx.buffer[63] = (byte) bits;
+	sha1Block(ctx);
+	for (int i = 0; i < 5; i++)
+	{
+		digest[i*4] = (byte) (ctx.state[i] >> 24);
+		digest[i*4+1] = (byte) (ctx.state[i] >> 16);
+		digest[i*4+2] = (byte) (ctx.state[i] >> 8);
+		digest[i*4+3] = (byte) ctx.state[i];
+	}
+}
+
+/**************************************************************************//**
+ * Function: hmacSha1Prepare
+ *
+ * Description:
+ * Hashes the key XORed with the inner and outer pads once, and keeps the
+ * resulting states so each message only pays for hashing itself.
+ *
+ * Parameters:
+ * const byte key[] - The 20 byte (localized) key
+ * snmpHmacKey & hmac - Receives the precomputed states
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void hmacSha1Prepare(const byte key[SNMP_SHA1_DIGEST_LEN], snmpHmacKey & hmac){
+	snmpSha1Context ctx;
+	byte pad[SNMP_SHA1_BLOCK_LEN];
+
+	memset(pad, 0x36, SNMP_SHA1_BLOCK_LEN);
+	for (int i = 0; i < SNMP_SHA1_DIGEST_LEN; i++)
+	{
+		pad[i] ^= key[i];
+	}
+	sha1Init(ctx);
+	sha1Update(ctx, pad, SNMP_SHA1_BLOCK_LEN);
+	memcpy(hmac.inner, ctx.state, sizeof(hmac.inner));
+
+	memset(pad, 0x5c, SNMP_SHA1_BLOCK_LEN);
+	for (int i = 0; i < SNMP_SHA1_DIGEST_LEN; i++)
+	{
+		pad[i] ^= key[i];
+	}
+	sha1Init(ctx);
+	sha1Update(ctx, pad, SNMP_SHA1_BLOCK_LEN);
+	memcpy(hmac.outer, ctx.state, sizeof(hmac.outer));
+}
+
+/**************************************************************************//**
+ * Function: hmacSha1
+ *
+ * Description:
+ * Computes HMAC-SHA-1 of data, starting from the states saved by
+ * hmacSha1Prepare.
+ *
+ * Parameters:
+ * const snmpHmacKey & hmac - The prepared key
+ * const byte *data - Data to authenticate
+ * uint16_t length - Number of bytes in data
+ * byte mac[] - Receives the 20 byte MAC (USM sends the first 12)
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void hmacSha1(const snmpHmacKey & hmac, const byte *data, uint16_t length, byte mac[SNMP_SHA1_DIGEST_LEN]){
+	snmpSha1Context ctx;
+
+	memcpy(ctx.state, hmac.inner, sizeof(ctx.state));
+	ctx.count = SNMP_SHA1_BLOCK_LEN;
+	sha1Update(ctx, data, length);
+	sha1Final(ctx, mac);
+
+	memcpy(ctx.state, hmac.outer, sizeof(ctx.state));
+	ctx.count = SNMP_SHA1_BLOCK_LEN;
+	sha1Update(ctx, mac, SNMP_SHA1_DIGEST_LEN);
+	sha1Final(ctx, mac);
+}
+
+/**************************************************************************//**
+ * Function: usmPasswordToKey
+ *
+ * Description:
+ * Turns a password into the key localized to an engine ID, as described
+ * in RFC 3414 appendix A.2.2. This hashes a megabyte of data and takes
+ * seconds on a small board, so it should be done once at startup (or
+ * done ahead of time and the key stored instead of the password).
+ *
+ * Parameters:
+ * const char *password - The user's authentication password
+ * const byte engineID[] - The agent's engine ID
+ * byte engineIDLength - Number of bytes in engineID
+ * byte key[] - Receives the 20 byte localized key
+ *
+ * Returns:
+ *  None
+ *
+ *****************************************************************************/
+void usmPasswordToKey(const char *password, const byte engineID[], byte engineIDLength, byte key[SNMP_SHA1_DIGEST_LEN]){
+	snmpSha1Context ctx;
+	uint32_t passwordLength = strlen(password);
+	uint32_t index = 0;
+
+	sha1Init(ctx);
+	if (passwordLength > 0)
+	{
+		// Hash 1MB made of the password repeated over and over
+		for (uint32_t count = 0; count < 1048576; count += SNMP_SHA1_BLOCK_LEN)
+		{
+			for (int i = 0; i < SNMP_SHA1_BLOCK_LEN; i++)
+			{
+				ctx.buffer[i] = password[index++ % passwordLength];
+			}
+			ctx.count += SNMP_SHA1_BLOCK_LEN;
+			sha1Block(ctx);
+		}
+	}
+	sha1Final(ctx, key);
+
+	// Localize: hash(key + engineID + key)
+	sha1Init(ctx);
+	sha1Update(ctx, key, SNMP_SHA1_DIGEST_LEN);
+	sha1Update(ctx, engineID, engineIDLength);
+	sha1Update(ctx, key, SNMP_SHA1_DIGEST_LEN);
+	sha1Final(ctx, key);
+}
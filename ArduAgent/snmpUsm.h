@@ -0,0 +1,55 @@
+/*
+  snmpUsm.h - SHA-1, HMAC and key localization for SNMPv3 USM.
+  Copyright (C) 2016 Adrian Del Grosso
+  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef snmpUsm_h
+#define snmpUsm_h
+
+#define SNMP_SHA1_DIGEST_LEN	20
+#define SNMP_SHA1_BLOCK_LEN		64
+#define SNMP_USM_AUTH_LEN		12	//HMAC-SHA-96 truncates the digest
+
+#include "Arduino.h"
+
+typedef struct {
+	uint32_t state[5];
+	uint32_t count;		// Bytes hashed so far
+	byte buffer[SNMP_SHA1_BLOCK_LEN];
+} snmpSha1Context;
+
+/*
+  HMAC key reduced to the hash states after the inner and outer padded
+  key blocks. Resuming from these saves hashing two blocks per message
+  and means the key itself doesn't need to be kept.
+*/
+typedef struct {
+	uint32_t inner[5];
+	uint32_t outer[5];
+} snmpHmacKey;
+
+void sha1Init(snmpSha1Context & ctx);
+void sha1Update(snmpSha1Context & ctx, const byte *data, uint32_t length);
+void sha1Final(snmpSha1Context & ctx, byte digest[SNMP_SHA1_DIGEST_LEN]);
+
+void hmacSha1Prepare(const byte key[SNMP_SHA1_DIGEST_LEN], snmpHmacKey & hmac);
+void hmacSha1(const snmpHmacKey & hmac, const byte *data, uint16_t length, byte mac[SNMP_SHA1_DIGEST_LEN]);
+
+void usmPasswordToKey(const char *password, const byte engineID[], byte engineIDLength, byte key[SNMP_SHA1_DIGEST_LEN]);
+
+#endif
@@ -8,6 +8,8 @@ static byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
 //static byte subnet[] = { 255, 255, 255, 0 };
 
 // RFC1213-MIB OIDs
+// Written as sent on the wire: .1.3 shares one byte (1*40+3 = 0x2b) and
+// arcs above 127 take several bytes (see SNMP_ARC2/SNMP_ARC3)
 // .iso (.1)
 // .iso.org (.1.3)
 // .iso.org.dod (.1.3.6)
@@ -16,29 +18,45 @@ static byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
 // .iso.org.dod.internet.mgmt.mib-2 (.1.3.6.1.2.1)
 // .iso.org.dod.internet.mgmt.mib-2.system (.1.3.6.1.2.1.1)
 // .iso.org.dod.internet.mgmt.mib-2.system.sysDescr (.1.3.6.1.2.1.1.1)
-int sysDescr[]     = {1,3,6,1,2,1,1,1,0};  // read-only  (DisplayString)
+const byte sysDescr[] = {0x2b,6,1,2,1,1,1,0};  // read-only  (DisplayString)
 // .iso.org.dod.internet.mgmt.mib-2.system.sysObjectID (.1.3.6.1.2.1.1.2)
-//static int sysObjectID[] = {1,3,6,1,2,1,1,2,0};  // read-only  (ObjectIdentifier)
+//static const byte sysObjectID[] = {0x2b,6,1,2,1,1,2,0};  // read-only  (ObjectIdentifier)
 // .iso.org.dod.internet.mgmt.mib-2.system.sysUpTime (.1.3.6.1.2.1.1.3)
-int sysUpTime[]     = {1,3,6,1,2,1,1,3,0};  // read-only  (TimeTicks)
+const byte sysUpTime[] = {0x2b,6,1,2,1,1,3,0};  // read-only  (TimeTicks)
 // .iso.org.dod.internet.mgmt.mib-2.system.sysContact (.1.3.6.1.2.1.1.4)
-int sysContact[]    = {1,3,6,1,2,1,1,4,0};  // read-write (DisplayString)
+const byte sysContact[] = {0x2b,6,1,2,1,1,4,0};  // read-write (DisplayString)
 // .iso.org.dod.internet.mgmt.mib-2.system.sysName (.1.3.6.1.2.1.1.5)
-int sysName[]       = {1,3,6,1,2,1,1,5,0};  // read-write (DisplayString)
+const byte sysName[] = {0x2b,6,1,2,1,1,5,0};  // read-write (DisplayString)
 // .iso.org.dod.internet.mgmt.mib-2.system.sysLocation (.1.3.6.1.2.1.1.6)
-int sysLocation[]   = {1,3,6,1,2,1,1,6,0};  // read-write (DisplayString)
+const byte sysLocation[] = {0x2b,6,1,2,1,1,6,0};  // read-write (DisplayString)
 // .iso.org.dod.internet.mgmt.mib-2.system.sysServices (.1.3.6.1.2.1.1.7)
-int sysServices[]   = {1,3,6,1,2,1,1,7,0};  // read-only  (Integer)
+const byte sysServices[] = {0x2b,6,1,2,1,1,7,0};  // read-only  (Integer)
 // .iso.org.dod.internet.mgmt.mib-2.hostresourcesMIB.hrUpTime (.1.3.6.1.2.1.25.1.1)
-int hrUpTime[]      = {1,3,6,1,2,1,25,1,1,0};
+const byte hrUpTime[] = {0x2b,6,1,2,1,25,1,1,0};
 //	Example Writable OID	(.1.3.6.1.2.1.11.30)
-int exampleWritableVar[]     = {1,3,6,1,2,1,11,30,0};
+const byte exampleWritableVar[] = {0x2b,6,1,2,1,11,30,0};
+//
+// OIDs answered below, in ascending order, so GETNEXT (snmpwalk) works
+const snmpMibEntry mib[] = {
+	{sysDescr, sizeof(sysDescr)},
+	{sysUpTime, sizeof(sysUpTime)},
+	{sysContact, sizeof(sysContact)},
+	{sysName, sizeof(sysName)},
+	{sysLocation, sizeof(sysLocation)},
+	{exampleWritableVar, sizeof(exampleWritableVar)},
+	{hrUpTime, sizeof(hrUpTime)},
+};
 //
 // Arduino defined OIDs
 // .iso.org.dod.internet.private (.1.3.6.1.4)
 // .iso.org.dod.internet.private.enterprises (.1.3.6.1.4.1)
 // .iso.org.dod.internet.private.enterprises.arduino (.1.3.6.1.4.1.36582)
 //
+// Analog input 0, sampled once a second by the agent. The last minute
+// plus its min/max/mean are under .1.3.6.1.4.1.36582.1 (see addSampler)
+const byte analogHistory[] = {0x2b,6,1,4,1,SNMP_ARC3(36582),1};
+snmpSampler analogSampler;
+//
 // RFC1213 local values
 	static char locDescr[]              = "Description";// read-only (static)
 	static uint32_t locUpTime           = 0;		    // read-only (static)
@@ -46,24 +64,34 @@ int exampleWritableVar[]     = {1,3,6,1,2,1,11,30,0};
 	static char locName[20]             = "arduAgent";	// read-only (static)
 	static char locLocation[20]         = "Somewhere USA";// read-only (static)
 	static int32_t locServices          = 6;			// read-only (static)
-  // Example writable value
-  int exampleWritable			= 0;			//Read-write
+  // Example writable value, safe to read while the agent writes it
+  snmpValueCell<int> exampleWritable;			//Read-write
 
 uint32_t prevMillis = millis();
 SNMP_API_STAT_CODES api_status;
 SNMP_ERR_CODES status;
 
+int32_t sampleAnalog()
+{
+	return analogRead(A0);
+}
+
 
 void pduReceived()
 {
 	api_status = arduAgent.requestPdu();
 	
 	if (api_status == SNMP_API_STAT_SUCCESS &&
-	arduAgent.requestType() == SNMP_GET){
+	(arduAgent.requestType() == SNMP_GET ||
+	arduAgent.requestType() == SNMP_GETNEXT ||
+	arduAgent.requestType() == SNMP_GETBULK)){
 		/*Check defined OID's against received one here:
 		You will need to edit this section for each
 		variable you want to have available to the agent*/
-		if(arduAgent.checkOID(sysDescr)){
+		if(arduAgent.respondSampler()){
+			// Answered by the agent
+		}
+		else if(arduAgent.checkOID(sysDescr)){
 			arduAgent.createResponsePDU(locDescr);
 		}
 		else if(arduAgent.checkOID(sysUpTime)){
@@ -118,7 +146,16 @@ void setup()
   //Serial.println("agent has begun");
   if ( api_status == SNMP_API_STAT_SUCCESS ) {
     arduAgent.onPduReceive(pduReceived);
-    
+    arduAgent.setMib(mib, sizeof(mib) / sizeof(mib[0]));
+    arduAgent.addSampler(analogSampler, analogHistory, sizeof(analogHistory), sampleAnalog, 1000);
+#if SNMP_USM
+    // SNMPv3 user "admin" with SHA authentication, built in when SNMP_USM
+    // is set to 1 in arduAgent.h. The key is worked out here once, which
+    // takes a few seconds. engineBoots (1 here) should be kept in EEPROM
+    // and go up by one on every start.
+    static const byte engineID[] = {0x80, 0x00, 0x8e, 0xe6, 0x04, 'a', 'r', 'd', 'u'};
+    arduAgent.beginUsm("admin", "maplesyrup", engineID, sizeof(engineID), 1);
+#endif
     return;
   }
   